@@ -0,0 +1,320 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* asynchronous positional reads and writes for the streams. Requests
+   go to io_uring where it is available, otherwise to a thread that
+   does the I/O while the caller carries on, otherwise they are done
+   on the spot. Requests may complete in any order, so the caller must
+   never have two in flight that overlap */
+
+#include "rzip.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_LIBURING) && defined(HAVE_LIBURING_H)
+#define USE_URING 1
+#include <liburing.h>
+#endif
+
+#define AIO_SYNC 0
+#define AIO_THREAD 1
+#define AIO_URING 2
+
+struct aio {
+	int mode;
+#ifdef USE_URING
+	struct io_uring ring;
+#endif
+#ifdef HAVE_LIBPTHREAD
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct aio_req *head, *tail;
+	int closing;
+#endif
+};
+
+static ssize_t req_len(struct aio_req *req)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i=0;i<req->iovcnt;i++) {
+		len += req->iov[i].iov_len;
+	}
+	return len;
+}
+
+/* finish a request that has moved done bytes so far. A write carries
+   on until everything is written; a read stops at the first short
+   transfer, as the caller may have asked for more than the file has */
+static void req_finish(struct aio_req *req, ssize_t done)
+{
+	struct iovec iov[AIO_MAX_IOV];
+	ssize_t ret, len = req_len(req);
+	int i, cnt = 0;
+
+	while (done >= 0 && done < len && req->write) {
+		ret = done;
+		cnt = 0;
+		for (i=0;i<req->iovcnt;i++) {
+			if (ret >= (ssize_t)req->iov[i].iov_len) {
+				ret -= req->iov[i].iov_len;
+				continue;
+			}
+			iov[cnt].iov_base = (char *)req->iov[i].iov_base + ret;
+			iov[cnt].iov_len = req->iov[i].iov_len - ret;
+			ret = 0;
+			cnt++;
+		}
+		ret = pwritev(req->fd, iov, cnt, req->offset + done);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret <= 0) {
+			req->err = ret ? errno : ENOSPC;
+			done = -1;
+			break;
+		}
+		done += ret;
+	}
+	req->ret = done;
+}
+
+/* do a request in the calling thread */
+static void req_run(struct aio_req *req)
+{
+	ssize_t ret;
+
+	do {
+		if (req->write) {
+			ret = pwritev(req->fd, req->iov, req->iovcnt, req->offset);
+		} else {
+			ret = preadv(req->fd, req->iov, req->iovcnt, req->offset);
+		}
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1) {
+		req->err = errno;
+	}
+	req_finish(req, ret);
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *aio_thread(void *arg)
+{
+	struct aio *aio = arg;
+	struct aio_req *req;
+
+	pthread_mutex_lock(&aio->lock);
+	for (;;) {
+		while (!aio->head && !aio->closing) {
+			pthread_cond_wait(&aio->work, &aio->lock);
+		}
+		if (!aio->head) break;
+
+		req = aio->head;
+		aio->head = req->next;
+		if (!aio->head) aio->tail = NULL;
+		pthread_mutex_unlock(&aio->lock);
+
+		req_run(req);
+
+		pthread_mutex_lock(&aio->lock);
+		req->done = 1;
+		pthread_cond_broadcast(&aio->done);
+	}
+	pthread_mutex_unlock(&aio->lock);
+	return NULL;
+}
+#endif
+
+/* set up an engine that can have up to depth requests in flight.
+   Returns NULL only if out of memory */
+void *aio_open(int depth)
+{
+	struct aio *aio;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio) {
+		return NULL;
+	}
+
+#ifdef USE_URING
+	if (io_uring_queue_init(depth, &aio->ring, 0) == 0) {
+		aio->mode = AIO_URING;
+		return aio;
+	}
+#else
+	(void)depth;
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->work, NULL);
+	pthread_cond_init(&aio->done, NULL);
+	if (pthread_create(&aio->thread, NULL, aio_thread, aio) == 0) {
+		aio->mode = AIO_THREAD;
+		return aio;
+	}
+	pthread_mutex_destroy(&aio->lock);
+	pthread_cond_destroy(&aio->work);
+	pthread_cond_destroy(&aio->done);
+#endif
+
+	aio->mode = AIO_SYNC;
+	return aio;
+}
+
+/* start a request. The iovecs and the buffers they point to must stay
+   untouched until aio_wait() has returned for it */
+void aio_submit(void *a, struct aio_req *req)
+{
+	struct aio *aio = a;
+
+	req->next = NULL;
+	req->done = 0;
+	req->err = 0;
+
+	switch (aio->mode) {
+#ifdef USE_URING
+	case AIO_URING: {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&aio->ring);
+		int ret;
+
+		if (!sqe) break;
+		if (req->write) {
+			io_uring_prep_writev(sqe, req->fd, req->iov, req->iovcnt,
+					     req->offset);
+		} else {
+			io_uring_prep_readv(sqe, req->fd, req->iov, req->iovcnt,
+					    req->offset);
+		}
+		io_uring_sqe_set_data(sqe, req);
+		do {
+			ret = io_uring_submit(&aio->ring);
+		} while (ret == -EINTR);
+		if (ret >= 0) return;
+
+		/* the entry stays in the ring and would go out with the
+		   next submit, so it is left there as a no-op that
+		   aio_wait() ignores */
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		break;
+	}
+#endif
+#ifdef HAVE_LIBPTHREAD
+	case AIO_THREAD:
+		pthread_mutex_lock(&aio->lock);
+		if (aio->tail) {
+			aio->tail->next = req;
+		} else {
+			aio->head = req;
+		}
+		aio->tail = req;
+		pthread_cond_signal(&aio->work);
+		pthread_mutex_unlock(&aio->lock);
+		return;
+#endif
+	default:
+		break;
+	}
+
+	/* no engine, or the ring was full */
+	req_run(req);
+	req->done = 1;
+}
+
+/* wait for a request to complete. Afterwards req->ret is the number of
+   bytes moved, or -1 with the error in req->err */
+void aio_wait(void *a, struct aio_req *req)
+{
+	struct aio *aio = a;
+
+	switch (aio->mode) {
+#ifdef USE_URING
+	case AIO_URING:
+		while (!req->done) {
+			struct io_uring_cqe *cqe;
+			struct aio_req *r;
+			int ret;
+
+			ret = io_uring_wait_cqe(&aio->ring, &cqe);
+			if (ret == -EINTR) continue;
+			if (ret < 0) {
+				fatal("io_uring wait failed - %s\n", strerror(-ret));
+			}
+			r = io_uring_cqe_get_data(cqe);
+			if (!r) {
+				/* a request that was run on the spot */
+				io_uring_cqe_seen(&aio->ring, cqe);
+				continue;
+			}
+			if (cqe->res < 0) {
+				r->err = -cqe->res;
+				r->ret = -1;
+			} else {
+				req_finish(r, cqe->res);
+			}
+			r->done = 1;
+			io_uring_cqe_seen(&aio->ring, cqe);
+		}
+		break;
+#endif
+#ifdef HAVE_LIBPTHREAD
+	case AIO_THREAD:
+		pthread_mutex_lock(&aio->lock);
+		while (!req->done) {
+			pthread_cond_wait(&aio->done, &aio->lock);
+		}
+		pthread_mutex_unlock(&aio->lock);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/* shut an engine down. Every request must have been waited for */
+void aio_close(void *a)
+{
+	struct aio *aio = a;
+
+	switch (aio->mode) {
+#ifdef USE_URING
+	case AIO_URING:
+		io_uring_queue_exit(&aio->ring);
+		break;
+#endif
+#ifdef HAVE_LIBPTHREAD
+	case AIO_THREAD:
+		pthread_mutex_lock(&aio->lock);
+		aio->closing = 1;
+		pthread_cond_signal(&aio->work);
+		pthread_mutex_unlock(&aio->lock);
+		pthread_join(aio->thread, NULL);
+		pthread_mutex_destroy(&aio->lock);
+		pthread_cond_destroy(&aio->work);
+		pthread_cond_destroy(&aio->done);
+		break;
+#endif
+	default:
+		break;
+	}
+	free(aio);
+}
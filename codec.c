@@ -0,0 +1,354 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* the backend compressors a stream block can be passed through. Each
+   block records its own c_type, so an archive may mix them and the
+   decoder only needs the codecs that were actually used */
+
+#include "rzip.h"
+#include "bzlib.h"
+
+#if defined(HAVE_LIBLZMA) && defined(HAVE_LZMA_H)
+#define USE_LZMA 1
+#include <lzma.h>
+#endif
+
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#define USE_ZSTD 1
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H)
+#define USE_LZ4 1
+#include <lz4.h>
+#endif
+
+/* the compress functions return 0 if the data compressed into at most
+   *dlen bytes, setting *dlen to the size used. The decompress functions
+   return 0 only if exactly dlen bytes came out */
+struct codec {
+	const char *name;
+	int c_type;
+	int (*compress)(uchar *dst, uint32 *dlen, const uchar *src,
+			uint32 slen, int level);
+	int (*decompress)(uchar *dst, uint32 dlen, const uchar *src,
+			  uint32 slen);
+};
+
+static int bzip2_compress(uchar *dst, uint32 *dlen, const uchar *src,
+			  uint32 slen, int level)
+{
+	unsigned int len = *dlen;
+
+	if (BZ2_bzBuffToBuffCompress((char *)dst, &len, (char *)src, slen,
+				     level, 0, level*10) != BZ_OK) {
+		return -1;
+	}
+	*dlen = len;
+	return 0;
+}
+
+static int bzip2_decompress(uchar *dst, uint32 dlen, const uchar *src,
+			    uint32 slen)
+{
+	unsigned int len = dlen;
+	int bzerr;
+
+	bzerr = BZ2_bzBuffToBuffDecompress((char *)dst, &len, (char *)src,
+					   slen, 0, 0);
+	if (bzerr != BZ_OK) {
+		err_msg("Failed to decompress buffer - bzerr=%d\n", bzerr);
+		return -1;
+	}
+	if (len != dlen) {
+		err_msg("Inconsistent length after decompression. Got %d bytes, expected %d\n", len, dlen);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef USE_LZMA
+static int lzma_compress(uchar *dst, uint32 *dlen, const uchar *src,
+			 uint32 slen, int level)
+{
+	size_t out_pos = 0;
+
+	if (lzma_easy_buffer_encode(level, LZMA_CHECK_NONE, NULL, src, slen,
+				    dst, &out_pos, *dlen) != LZMA_OK) {
+		return -1;
+	}
+	*dlen = out_pos;
+	return 0;
+}
+
+static int lzma_decompress(uchar *dst, uint32 dlen, const uchar *src,
+			   uint32 slen)
+{
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0, out_pos = 0;
+	lzma_ret ret;
+
+	ret = lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &in_pos, slen,
+					dst, &out_pos, dlen);
+	if (ret != LZMA_OK) {
+		err_msg("Failed to decompress buffer - lzma error %d\n", ret);
+		return -1;
+	}
+	if (out_pos != dlen) {
+		err_msg("Inconsistent length after decompression. Got %d bytes, expected %d\n", (int)out_pos, dlen);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+static int zstd_compress(uchar *dst, uint32 *dlen, const uchar *src,
+			 uint32 slen, int level)
+{
+	size_t ret;
+
+	/* spread levels 1-9 over zstd's 3-19 */
+	ret = ZSTD_compress(dst, *dlen, src, slen, 2*level + 1);
+	if (ZSTD_isError(ret)) {
+		return -1;
+	}
+	*dlen = ret;
+	return 0;
+}
+
+static int zstd_decompress(uchar *dst, uint32 dlen, const uchar *src,
+			   uint32 slen)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(dst, dlen, src, slen);
+	if (ZSTD_isError(ret)) {
+		err_msg("Failed to decompress buffer - %s\n",
+			ZSTD_getErrorName(ret));
+		return -1;
+	}
+	if (ret != dlen) {
+		err_msg("Inconsistent length after decompression. Got %d bytes, expected %d\n", (int)ret, dlen);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef USE_LZ4
+static int lz4_compress(uchar *dst, uint32 *dlen, const uchar *src,
+			uint32 slen, int level)
+{
+	int ret;
+
+	/* lz4 trades ratio for speed with its acceleration factor, so
+	   the lower levels accelerate */
+	ret = LZ4_compress_fast((const char *)src, (char *)dst, slen, *dlen,
+				10 - level);
+	if (ret <= 0) {
+		return -1;
+	}
+	*dlen = ret;
+	return 0;
+}
+
+static int lz4_decompress(uchar *dst, uint32 dlen, const uchar *src,
+			  uint32 slen)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe((const char *)src, (char *)dst, slen, dlen);
+	if (ret < 0) {
+		err_msg("Failed to decompress buffer - lz4 error %d\n", ret);
+		return -1;
+	}
+	if ((uint32)ret != dlen) {
+		err_msg("Inconsistent length after decompression. Got %d bytes, expected %d\n", ret, dlen);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/* kept in order of increasing decompression cost, which codec_choose()
+   relies on */
+static const struct codec codecs[] = {
+#ifdef USE_LZ4
+	{ "lz4", CTYPE_LZ4, lz4_compress, lz4_decompress },
+#endif
+#ifdef USE_ZSTD
+	{ "zstd", CTYPE_ZSTD, zstd_compress, zstd_decompress },
+#endif
+#ifdef USE_LZMA
+	{ "lzma", CTYPE_LZMA, lzma_compress, lzma_decompress },
+#endif
+	{ "bzip2", CTYPE_BZIP2, bzip2_compress, bzip2_decompress },
+	{ NULL, 0, NULL, NULL }
+};
+
+static const struct codec *find_codec(int c_type)
+{
+	int i;
+
+	for (i=0;codecs[i].name;i++) {
+		if (codecs[i].c_type == c_type) return &codecs[i];
+	}
+	return NULL;
+}
+
+/* find a codec by name. Returns its c_type, or -1 if it is unknown or
+   was not built in */
+int codec_type(const char *name)
+{
+	int i;
+
+	for (i=0;codecs[i].name;i++) {
+		if (strcmp(codecs[i].name, name) == 0) return codecs[i].c_type;
+	}
+	if (strcmp(name, "auto") == 0) return CODEC_AUTO;
+	return -1;
+}
+
+/* list the codecs that were built in */
+void codec_list(FILE *f)
+{
+	int i;
+
+	for (i=0;codecs[i].name;i++) {
+		fprintf(f, "%s ", codecs[i].name);
+	}
+	fprintf(f, "auto");
+}
+
+/* compress slen bytes of src into at most *dlen bytes of dst at level
+   1-9. Return 0 on success, or -1 if the codec failed or the result
+   did not fit */
+int codec_compress(int c_type, int level, uchar *dst, uint32 *dlen,
+		   const uchar *src, uint32 slen)
+{
+	const struct codec *c = find_codec(c_type);
+
+	if (!c) return -1;
+	return c->compress(dst, dlen, src, slen, level);
+}
+
+/* decompress slen bytes of src into exactly dlen bytes of dst. Return
+   -1 on failure */
+int codec_decompress(int c_type, uchar *dst, uint32 dlen,
+		     const uchar *src, uint32 slen)
+{
+	const struct codec *c = find_codec(c_type);
+
+	if (!c) {
+		err_msg("Unsupported compression type %d - this rzip was built without it\n", c_type);
+		return -1;
+	}
+	return c->decompress(dst, dlen, src, slen);
+}
+
+/* log2(x) for x > 0, in 16.16 fixed point */
+static uint32 log2_fixed(uint32 x)
+{
+	uint32 n = 31 - __builtin_clz(x);
+	uint64_t z = ((uint64_t)x << 31) >> n;
+	uint32 y = n << 16;
+	uint32 bit;
+
+	for (bit = 1<<15; bit; bit >>= 1) {
+		z = (z * z) >> 31;
+		if (z >= (1ULL << 32)) {
+			z >>= 1;
+			y |= bit;
+		}
+	}
+	return y;
+}
+
+/* order 0 entropy in bits per byte, 16.16 fixed point, of len bytes
+   with the given byte counts */
+uint32 count_entropy(const uint32 *count, uint32 len)
+{
+	uint64_t sum = 0;
+	uint32 i;
+
+	if (len == 0) return 0;
+	for (i=0;i<256;i++) {
+		if (count[i]) sum += (uint64_t)count[i] * log2_fixed(count[i]);
+	}
+	return ((uint64_t)len * log2_fixed(len) - sum) / len;
+}
+
+static uint32 entropy(const uchar *buf, uint32 len)
+{
+	uint32 count[256];
+	uint32 i;
+
+	memset(count, 0, sizeof(count));
+	for (i=0;i<len;i++) {
+		count[buf[i]]++;
+	}
+	return count_entropy(count, len);
+}
+
+#define SAMPLE_SLICE (16*1024)
+#define SAMPLE_SIZE (3*SAMPLE_SLICE)
+#define ENTROPY_STORE (7.9 * 65536)
+#define ENTROPY_FAST (7.0 * 65536)
+
+/* pick a codec and level for a block, as used by -C auto. A block
+   whose bytes are close to uniformly distributed (already compressed
+   media, encrypted data) is stored without trying any codec. Otherwise
+   a sample from the start, middle and end of the block is compressed
+   with each codec, and the cheapest to decompress wins unless a slower
+   one is more than 3% smaller. Returns the c_type, or CTYPE_NONE */
+int codec_choose(const uchar *buf, uint32 len, int *level)
+{
+	uchar sample[SAMPLE_SIZE], out[SAMPLE_SIZE];
+	const uchar *s = buf;
+	uint32 e, slen = len, best_len = 0;
+	int i, best = CTYPE_NONE;
+
+	e = entropy(buf, len);
+	if (e >= ENTROPY_STORE) return CTYPE_NONE;
+
+	/* the higher levels buy little on data that is nearly random */
+	if (e >= ENTROPY_FAST) *level = 1;
+
+	if (len > SAMPLE_SIZE) {
+		memcpy(sample, buf, SAMPLE_SLICE);
+		memcpy(sample + SAMPLE_SLICE, buf + len/2 - SAMPLE_SLICE/2,
+		       SAMPLE_SLICE);
+		memcpy(sample + 2*SAMPLE_SLICE, buf + len - SAMPLE_SLICE,
+		       SAMPLE_SLICE);
+		s = sample;
+		slen = SAMPLE_SIZE;
+	}
+
+	for (i=0;codecs[i].name;i++) {
+		uint32 dlen = slen - 1;
+
+		if (codecs[i].compress(out, &dlen, s, slen, *level) != 0) {
+			continue;
+		}
+		if (best == CTYPE_NONE || dlen < best_len - best_len/32) {
+			best = codecs[i].c_type;
+			best_len = dlen;
+		}
+	}
+	return best;
+}
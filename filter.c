@@ -0,0 +1,222 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* reversible transforms a block of literals can be passed through
+   before its codec, so that the codec sees more regular data. The
+   filter is picked per block and its id kept in the top bits of the
+   block's c_type */
+
+#include "rzip.h"
+
+/* x86 code: the 24 bit displacement of a call or jmp whose top byte
+   says it is near is made absolute, so that every call of the same
+   function looks the same. Only those three bytes ever change, and
+   they are always skipped over, so both directions see the same
+   opcodes and top bytes */
+static void x86_convert(uchar *buf, uint32 len, int undo)
+{
+	uint32 i, a;
+
+	for (i=0;i+5<=len;) {
+		if ((buf[i] & 0xFE) != 0xE8) {
+			i++;
+			continue;
+		}
+		if (buf[i+4] != 0x00 && buf[i+4] != 0xFF) {
+			i += 5;
+			continue;
+		}
+		a = buf[i+1] | (buf[i+2]<<8) | (buf[i+3]<<16);
+		if (undo) {
+			a -= i + 5;
+		} else {
+			a += i + 5;
+		}
+		buf[i+1] = a & 0xFF;
+		buf[i+2] = (a>>8) & 0xFF;
+		buf[i+3] = (a>>16) & 0xFF;
+		i += 5;
+	}
+}
+
+/* arrays of 1, 2, 4 or 8 byte numbers that change slowly: each byte
+   becomes its difference from the byte dist back */
+static void delta_encode(uchar *dst, const uchar *src, uint32 len, int dist)
+{
+	uint32 i;
+
+	for (i=0;i<len && i<(uint32)dist;i++) {
+		dst[i] = src[i];
+	}
+	for (;i<len;i++) {
+		dst[i] = src[i] - src[i-dist];
+	}
+}
+
+static void delta_decode(uchar *buf, uint32 len, int dist)
+{
+	uint32 i;
+
+	for (i=dist;i<len;i++) {
+		buf[i] += buf[i-dist];
+	}
+}
+
+/* fixed width records: byte k of every record is gathered together,
+   so the slowly changing high bytes of numbers end up side by side.
+   Any partial record at the end is left where it is */
+static void transpose(uchar *dst, const uchar *src, uint32 len, int width,
+		      int undo)
+{
+	uint32 rows = len / width, r;
+	int k;
+
+	for (k=0;k<width;k++) {
+		for (r=0;r<rows;r++) {
+			if (undo) {
+				dst[r*width + k] = src[k*rows + r];
+			} else {
+				dst[k*rows + r] = src[r*width + k];
+			}
+		}
+	}
+	memcpy(dst + rows*width, src + rows*width, len - rows*width);
+}
+
+/* apply filter f to len bytes of src, giving dst */
+void filter_encode(int f, uchar *dst, const uchar *src, uint32 len)
+{
+	switch (f) {
+	case FILTER_X86:
+		memcpy(dst, src, len);
+		x86_convert(dst, len, 0);
+		break;
+	case FILTER_DELTA1:
+	case FILTER_DELTA2:
+	case FILTER_DELTA4:
+	case FILTER_DELTA8:
+		delta_encode(dst, src, len, 1 << (f - FILTER_DELTA1));
+		break;
+	case FILTER_TRANSPOSE4:
+		transpose(dst, src, len, 4, 0);
+		break;
+	case FILTER_TRANSPOSE8:
+		transpose(dst, src, len, 8, 0);
+		break;
+	default:
+		memcpy(dst, src, len);
+		break;
+	}
+}
+
+/* undo filter f on len bytes of buf, in place. tmp must hold len bytes.
+   Return -1 if the filter is unknown */
+int filter_decode(int f, uchar *buf, uchar *tmp, uint32 len)
+{
+	switch (f) {
+	case FILTER_NONE:
+		break;
+	case FILTER_X86:
+		x86_convert(buf, len, 1);
+		break;
+	case FILTER_DELTA1:
+	case FILTER_DELTA2:
+	case FILTER_DELTA4:
+	case FILTER_DELTA8:
+		delta_decode(buf, len, 1 << (f - FILTER_DELTA1));
+		break;
+	case FILTER_TRANSPOSE4:
+	case FILTER_TRANSPOSE8:
+		transpose(tmp, buf, len, f == FILTER_TRANSPOSE4 ? 4 : 8, 1);
+		memcpy(buf, tmp, len);
+		break;
+	default:
+		err_msg("Unknown filter %d - this rzip is too old for the archive\n", f);
+		return -1;
+	}
+	return 0;
+}
+
+#define SAMPLE_LEN (64*1024)
+#define X86_DENSITY 1024
+#define FILTER_GAIN (0.5 * 65536)
+
+/* pick a filter for a block of literals. A block with a near call or
+   jmp every X86_DENSITY bytes or so is taken to be x86 code; random
+   data has one every 16KB. Otherwise the order 0 entropy of a sample
+   is measured after each delta, and per byte lane for each transpose,
+   and the lowest wins if it is FILTER_GAIN bits a byte better than
+   the block as it stands. Returns a FILTER_* id */
+int filter_choose(const uchar *buf, uint32 len)
+{
+	uint32 count[8][256];
+	uint32 i, n, e, best_e, calls = 0;
+	const uchar *s;
+	int d, k, best = FILTER_NONE;
+
+	/* the middle of the block, clear of any headers */
+	n = MIN(len, SAMPLE_LEN);
+	s = buf + (len - n)/2;
+	if (n < 1024) return FILTER_NONE;
+
+	for (i=0;i+5<=n;i++) {
+		if ((s[i] & 0xFE) == 0xE8 && (s[i+4] == 0x00 || s[i+4] == 0xFF)) {
+			calls++;
+		}
+	}
+	if (calls > n / X86_DENSITY) return FILTER_X86;
+
+	memset(count[0], 0, sizeof(count[0]));
+	for (i=0;i<n;i++) {
+		count[0][s[i]]++;
+	}
+	best_e = count_entropy(count[0], n);
+	if (best_e < FILTER_GAIN) return FILTER_NONE;
+	best_e -= FILTER_GAIN;
+
+	for (d=0;d<4;d++) {
+		int dist = 1 << d;
+
+		memset(count[0], 0, sizeof(count[0]));
+		for (i=dist;i<n;i++) {
+			count[0][(uchar)(s[i] - s[i-dist])]++;
+		}
+		e = count_entropy(count[0], n - dist);
+		if (e < best_e) {
+			best_e = e;
+			best = FILTER_DELTA1 + d;
+		}
+	}
+
+	for (d=4;d<=8;d+=4) {
+		uint32 rows = n / d;
+
+		memset(count, 0, sizeof(count[0]) * d);
+		for (i=0;i<rows*d;i++) {
+			count[i % d][s[i]]++;
+		}
+		for (e=0, k=0;k<d;k++) {
+			e += count_entropy(count[k], rows) / d;
+		}
+		if (e < best_e) {
+			best_e = e;
+			best = d == 4 ? FILTER_TRANSPOSE4 : FILTER_TRANSPOSE8;
+		}
+	}
+
+	return best;
+}
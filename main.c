@@ -19,6 +19,24 @@
 
 #include "rzip.h"
 
+#ifdef HAVE_GETOPT_LONG
+#include <getopt.h>
+
+static const struct option long_options[] = {
+	{ "rsyncable", no_argument, NULL, 'R' },
+	{ "readahead", required_argument, NULL, 'A' },
+	{ "threads", required_argument, NULL, 'p' },
+	{ "queue", required_argument, NULL, 'U' },
+	{ "codec", required_argument, NULL, 'C' },
+	{ "stdout", no_argument, NULL, 'c' },
+	{ "direct", no_argument, NULL, 'N' },
+	{ "block-size", required_argument, NULL, 'B' },
+	{ NULL, 0, NULL, 0 }
+};
+#endif
+
+#define SHORT_OPTIONS "h0123456789dS:tVvkfPo:L:q:Q:D:F:RA:p:U:C:cNB:"
+
 static void usage(void)
 {
 	printf("rzip %d.%d\n", RZIP_MAJOR_VERSION, RZIP_MINOR_VERSION);
@@ -30,6 +48,7 @@ static void usage(void)
 	printf("     -6            default compression level\n");
 	printf("     -9            slowest (best) compression\n");
 	printf("     -d            decompress\n");
+	printf("     -t            test compressed file integrity\n");
 	printf("     -o filename   specify the output file name\n");
 	printf("     -S suffix     specify compressed suffix (default '.rz')\n");
 	printf("     -f            force overwrite of any existing files\n");
@@ -38,72 +57,78 @@ static void usage(void)
 	printf("     -L level      set compression level\n");
 	printf("     -V            show version\n");
 	printf("     -q file       temporary file for input\n");
-	printf("     -Q file       temporary file for output\n");
-#if 0
-	/* damn, this will be quite hard to do */
-	printf("     -t          test compressed file integrity\n");
-#endif
+	printf("     -Q file       temporary file for compressed output\n");
+	printf("     -c            write to stdout, no temporary file needed\n");
+	printf("     -N            keep the page cache clear for bulk jobs (--direct)\n");
+	printf("     -D file       delta against a reference file\n");
+	printf("     -F file       deduplicate against a fingerprint store\n");
+	printf("     -R            rsync friendly output (--rsyncable)\n");
+	printf("     -A MB         read ahead of the next chunk (default 64)\n");
+	printf("     -p threads    compression threads (default one per cpu)\n");
+	printf("     -U blocks     most blocks queued for compression (default 2 per thread)\n");
+	printf("     -B KB         stream block size (default 100KB per bzip2 level)\n");
+	printf("     -C codec      backend compressor (");
+	codec_list(stdout);
+	printf(", default bzip2)\n");
 	printf("\n"); 
-	printf("to read from stdin -q is necessary\n"); 
-	printf("to write to stdout -Q is necessary\n"); 
+	printf("to compress stdin give - as the file name; to decompress it -q is necessary\n"); 
+	printf("to write to stdout give -c\n"); 
 	printf("reading from stdin and writing to stdout while compressing results in files\n"); 
 	printf("that cannot be decompressed with plain rzip\n"); 
 }
 
 
-static void write_magic(int fd_in, int fd_out)
+static void fill_magic(struct rzip_control *control, char *magic, off_t l)
 {
-	struct stat st;
-	char magic[24];
 	uint32_t v;
 
-	memset(magic, 0, sizeof(magic));
+	memset(magic, 0, 24);
 	strcpy(magic, "RZIP");
 	magic[4] = RZIP_MAJOR_VERSION;
-	magic[5] = RZIP_MINOR_VERSION;
-
-	if (fd_in && fstat(fd_in, &st) != 0) {
-		fatal("bad magic file descriptor!?\n");
-	} else if(!fd_in) {
-		st.st_size=0;
-	}
-	
+	magic[5] = control->magic_flags ? RZIP_MINOR_VERSION :
+		RZIP_PLAIN_MINOR_VERSION;
 
 #if HAVE_LARGE_FILES
-	v = htonl(st.st_size & 0xFFFFFFFF);
+	v = htonl(l & 0xFFFFFFFF);
 	memcpy(&magic[6], &v, 4);
-	v = htonl(st.st_size >> 32);
+	v = htonl(l >> 32);
 	memcpy(&magic[10], &v, 4);
 #else
-	v = htonl(st.st_size);
+	v = htonl(l);
 	memcpy(&magic[6], &v, 4);
 #endif
 
+	magic[14] = control->magic_flags & 0xFF;
+	magic[15] = (control->magic_flags >> 8) & 0xFF;
+
+	/* the stream block size, 0 in archives from before it was kept */
+	v = htonl(control->block_size);
+	memcpy(&magic[16], &v, 4);
+}
+
+static void write_magic(struct rzip_control *control, int fd_in, int fd_out)
+{
+	struct stat st;
+	char magic[24];
+
+	if (fd_in && fstat(fd_in, &st) != 0) {
+		fatal("bad magic file descriptor!?\n");
+	} else if(!fd_in) {
+		st.st_size=0;
+	}
+
+	fill_magic(control, magic, st.st_size);
+
 	if (write(fd_out, magic, sizeof(magic)) != sizeof(magic)) {
 		fatal("Failed to write magic header\n");
 	}
 }
 
-static void update_magic(off_t l, int fd_out)
+static void update_magic(struct rzip_control *control, off_t l, int fd_out)
 {
 	char magic[24];
-	uint32_t v;
-
-	memset(magic, 0, sizeof(magic));
-	strcpy(magic, "RZIP");
-	magic[4] = RZIP_MAJOR_VERSION;
-	magic[5] = RZIP_MINOR_VERSION;
 
-
-#if HAVE_LARGE_FILES
-	v = htonl(l & 0xFFFFFFFF);
-	memcpy(&magic[6], &v, 4);
-	v = htonl(l >> 32);
-	memcpy(&magic[10], &v, 4);
-#else
-	v = htonl(l
-	memcpy(&magic[6], &v, 4);
-#endif
+	fill_magic(control, magic, l);
 
 	if(lseek(fd_out,0,SEEK_SET)==-1)
 		fatal("Failed to seek\n");
@@ -113,7 +138,7 @@ static void update_magic(off_t l, int fd_out)
 	}
 }
 
-static void read_magic(int fd_in, int fd_out, off_t *expected_size)
+void read_magic(struct rzip_control *control, int fd_in, off_t *expected_size)
 {
 	uint32_t v;
 	char magic[24];
@@ -128,6 +153,12 @@ static void read_magic(int fd_in, int fd_out, off_t *expected_size)
 		fatal("Not an rzip file\n");
 	}
 
+	if (magic[4] > RZIP_MAJOR_VERSION ||
+	    (magic[4] == RZIP_MAJOR_VERSION && magic[5] > RZIP_MINOR_VERSION)) {
+		fatal("Unsupported rzip version %d.%d - this rzip reads up to %d.%d\n",
+		      magic[4], magic[5], RZIP_MAJOR_VERSION, RZIP_MINOR_VERSION);
+	}
+
 #if HAVE_LARGE_FILES
 	memcpy(&v, &magic[6], 4);
 	*expected_size = ntohl(v);
@@ -138,6 +169,17 @@ static void read_magic(int fd_in, int fd_out, off_t *expected_size)
 	*expected_size = ntohl(v);
 #endif
 
+	control->magic_flags = (uchar)magic[14] | ((uchar)magic[15] << 8);
+	if (control->magic_flags & ~MAGIC_KNOWN_FLAGS) {
+		fatal("Unsupported rzip format flags 0x%x\n",
+		      control->magic_flags);
+	}
+
+	memcpy(&v, &magic[16], 4);
+	control->block_size = ntohl(v);
+	if (control->block_size > MAX_BLOCK_SIZE) {
+		fatal("Bad stream block size %u\n", control->block_size);
+	}
 }
 
 
@@ -165,10 +207,12 @@ static void preserve_perms(struct rzip_control *control,
 */
 static void decompress_file(struct rzip_control *control)
 {
-	int fd_in, fd_out = -1, fd_hist = -1;
+	int fd_in, fd_out = -1, fd_hist = -1, in_is_pipe;
+	int out_is_pipe = control->out_tmp || (control->flags & FLAG_STDOUT);
 	off_t expected_size;
 
-	if(control->out_tmp) {
+	/* a test writes nothing, so the name needs no suffix */
+	if(out_is_pipe || (control->flags & FLAG_TEST_ONLY)) {
 		control->outfile = strdup("-");
 	} else {
 		if (control->outname) {
@@ -193,6 +237,8 @@ static void decompress_file(struct rzip_control *control)
 			      control->in_tmp, 
 			      strerror(errno));
 		}
+	} else if (control->flags & FLAG_STDIN) {
+		fd_in = STDIN_FILENO;
 	} else {
 		fd_in = open(control->infile,O_RDONLY);
 		if (fd_in == -1) {
@@ -202,18 +248,19 @@ static void decompress_file(struct rzip_control *control)
 		}
 	}
 
-	if ((control->flags & FLAG_TEST_ONLY) == 0 && ! control->out_tmp) {
+	if ((control->flags & FLAG_TEST_ONLY) == 0 && !out_is_pipe) {
+		/* read and write, so that runzip can map it */
 		if (control->flags & FLAG_FORCE_REPLACE) {
-			fd_out = open(control->outfile,O_WRONLY|O_CREAT|O_TRUNC,0666);
+			fd_out = open(control->outfile,O_RDWR|O_CREAT|O_TRUNC,0666);
 		} else {
-			fd_out = open(control->outfile,O_WRONLY|O_CREAT|O_EXCL,0666);
+			fd_out = open(control->outfile,O_RDWR|O_CREAT|O_EXCL,0666);
 		}
 		if (fd_out == -1) {
 			fatal("Failed to create %s: %s\n", 
 			      control->outfile, strerror(errno));
 		}
 
-		if(!control->in_tmp)
+		if(!control->in_tmp && !(control->flags & FLAG_STDIN))
 			preserve_perms(control, fd_in, fd_out);
 		
 		fd_hist = open(control->outfile,O_RDONLY);
@@ -221,26 +268,57 @@ static void decompress_file(struct rzip_control *control)
 			fatal("Failed to open history file %s\n", 
 			      control->outfile);
 		}
-	} else if(control->out_tmp) {
-		fd_out = open(control->out_tmp,O_RDWR|O_CREAT|O_EXCL,0600);
-		if (fd_out == -1) {
-			fatal("Failed to create %s: %s\n", 
-			      control->out_tmp, strerror(errno));
+	} else if(out_is_pipe) {
+		/* runzip keeps the history in memory, so the -Q file is
+		   not needed */
+		fd_out = STDOUT_FILENO;
+	}
+
+
+	
+	read_magic(control, control->in_tmp?STDIN_FILENO:fd_in, &expected_size);
+
+	in_is_pipe = control->in_tmp ? 1 : 0;
+	if (control->magic_flags & MAGIC_FORWARD) {
+		/* the forward format reads straight through, so stdin
+		   needs no temporary copy */
+		if (control->in_tmp) {
+			fd_in = STDIN_FILENO;
 		}
+		in_is_pipe = 0;
+	} else if (control->flags & FLAG_STDIN) {
+		fatal("Only archives written with -c can be read from stdin without -q\n");
+	}
 
-		fd_hist = open(control->out_tmp,O_RDONLY);
-		if (fd_hist == -1) {
-			fatal("Failed to open history file %s\n", 
-			      control->out_tmp);
+	if (control->flags & FLAG_TEST_ONLY) {
+		if (in_is_pipe) {
+			fatal("Only archives written with -c can be tested from a pipe\n");
+		}
+		if (verify_fd(control, fd_in) != 0) {
+			fatal("%s failed the integrity test\n", control->infile);
 		}
+		if (control->verbosity > 0) {
+			printf("%s: OK\n", control->infile);
+		}
+		close(fd_in);
+		if (control->in_tmp) unlink(control->in_tmp);
+		free(control->outfile);
+		return;
+	}
+
+	if ((control->magic_flags & MAGIC_REFERENCE) && !control->reference) {
+		fatal("%s was compressed against a reference file - use -D\n",
+		      control->infile);
 	}
 
+	if ((control->magic_flags & MAGIC_STORE) && !control->store) {
+		fatal("%s refers to a fingerprint store - use -F\n",
+		      control->infile);
+	}
 
+	runzip_fd(control, fd_in, fd_out, fd_hist, expected_size,out_is_pipe,in_is_pipe);
 	
-	read_magic(control->in_tmp?STDIN_FILENO:fd_in, fd_out, &expected_size);
-	runzip_fd(fd_in, fd_out, fd_hist, expected_size,control->out_tmp?1:0,control->in_tmp?1:0);
-	
-	if ((control->flags & FLAG_TEST_ONLY) == 0) {
+	if (!out_is_pipe) {
 		if (close(fd_hist) != 0 ||
 		    close(fd_out) != 0) {
 			fatal("Failed to close files\n");
@@ -249,14 +327,14 @@ static void decompress_file(struct rzip_control *control)
 
 	close(fd_in);
 
-
-	if(control->out_tmp)
-		unlink(control->out_tmp);
-
 	if(control->in_tmp)
 		unlink(control->in_tmp);
-	else if ((control->flags & (FLAG_KEEP_FILES | FLAG_TEST_ONLY)) == 0) {
-		if (unlink(control->infile) != 0) {
+	else if ((control->flags & (FLAG_KEEP_FILES | FLAG_TEST_ONLY | FLAG_STDIN)) == 0) {
+		/* later archives may need it to decompress */
+		if (control->store && store_holds(control->store, control->infile)) {
+			err_msg("Keeping %s - the fingerprint store refers to it\n",
+				control->infile);
+		} else if (unlink(control->infile) != 0) {
 			fatal("Failed to unlink %s: %s\n", 
 			      control->infile, strerror(errno));
 		}
@@ -297,6 +375,8 @@ static void compress_file(struct rzip_control *control)
 			fatal("Failed to open %s: %s\n", control->in_tmp, strerror(errno));
 		}
 
+	} else if (control->flags & FLAG_STDIN) {
+		fd_in = STDIN_FILENO;
 	} else {
 		fd_in = open(control->infile,O_RDONLY);
 		if (fd_in == -1) {
@@ -304,7 +384,9 @@ static void compress_file(struct rzip_control *control)
 		}
 	}
 	
-	if(control->out_tmp) {
+	if (control->flags & FLAG_STDOUT) {
+		fd_out = STDOUT_FILENO;
+	} else if(control->out_tmp) {
 		fd_out = open(control->out_tmp,O_RDWR|O_CREAT|O_EXCL,0600);
 		if (fd_out == -1) {
 			fatal("Failed to open %s: %s\n", control->out_tmp, strerror(errno));
@@ -320,19 +402,49 @@ static void compress_file(struct rzip_control *control)
 		}
 	}
 
-	if(!control->in_tmp && !control->out_tmp)
+	if(!control->in_tmp && !(control->flags & (FLAG_STDIN | FLAG_STDOUT)) &&
+	   !control->out_tmp)
 		preserve_perms(control, fd_in, fd_out);
 
-	if(!control->in_tmp) {
-		write_magic(fd_in, fd_out);
+	/* new archives keep the record types, lengths and offsets in
+	   streams of their own, with the numbers as varints and repeated
+	   match distances sent as a slot in a small cache */
+	control->magic_flags = MAGIC_SPLIT | MAGIC_VARINT | MAGIC_REPEAT |
+		MAGIC_BLOCK_CRC;
+	if (!control->block_size) {
+		control->block_size = level_block_size(control->compression_level);
+	}
+	if (control->reference) {
+		control->magic_flags |= MAGIC_REFERENCE;
+	}
+	if (control->flags & FLAG_STDOUT) {
+		/* nothing can be patched in a pipe, so the streams use
+		   the forward format and the size stays unknown (0) when
+		   reading stdin */
+		control->magic_flags |= MAGIC_FORWARD;
+	}
+
+	if(!control->in_tmp && !(control->flags & FLAG_STDIN)) {
+		write_magic(control, fd_in, fd_out);
 	} else {
-		write_magic(0, fd_out);
+		write_magic(control, 0, fd_out);
 	}
 
 	l = rzip_fd(control, fd_in, fd_out);
 
-	if(control->in_tmp && !control->out_tmp) {
-		update_magic(l, fd_out);
+	if((((control->in_tmp || (control->flags & FLAG_STDIN)) && !control->out_tmp) ||
+	    (control->magic_flags & MAGIC_STORE)) &&
+	   !(control->flags & FLAG_STDOUT)) {
+		update_magic(control, l, fd_out);
+	}
+
+	if (control->store) {
+		char *path = realpath(control->outfile, NULL);
+		if (!path) {
+			fatal("Failed to find full path of %s\n", control->outfile);
+		}
+		store_commit(control->store, path, l);
+		free(path);
 	}
 
 	if (close(fd_in) != 0 ||
@@ -345,7 +457,7 @@ static void compress_file(struct rzip_control *control)
 
 	if(control->in_tmp) {
 		unlink (control->in_tmp);
-	} else if ((control->flags & FLAG_KEEP_FILES) == 0) {
+	} else if ((control->flags & (FLAG_KEEP_FILES | FLAG_STDIN)) == 0) {
 		if (unlink(control->infile) != 0) {
 			fatal("Failed to unlink %s: %s\n", control->infile, strerror(errno));
 		}
@@ -364,6 +476,10 @@ static void compress_file(struct rzip_control *control)
 	memset(&control, 0, sizeof(control));
 
 	control.compression_level = 6;
+	control.readahead_mb = 64;
+	i = sysconf(_SC_NPROCESSORS_ONLN);
+	control.threads = MIN(MAX(i, 1), MAX_THREADS);
+	control.codec = CTYPE_BZIP2;
 	control.flags = 0;
 	control.suffix = ".rz";
 
@@ -371,7 +487,11 @@ static void compress_file(struct rzip_control *control)
 		control.flags |= FLAG_DECOMPRESS;
 	}
 
-	while ((c = getopt(argc, argv, "h0123456789dS:tVvkfPo:L:q:Q:")) != -1) {
+#ifdef HAVE_GETOPT_LONG
+	while ((c = getopt_long(argc, argv, SHORT_OPTIONS, long_options, NULL)) != -1) {
+#else
+	while ((c = getopt(argc, argv, SHORT_OPTIONS)) != -1) {
+#endif
 		if (isdigit(c)) {
 			control.compression_level = c - '0';
 			continue;
@@ -396,8 +516,60 @@ static void compress_file(struct rzip_control *control)
 			control.out_tmp = optarg;
 			control.flags |= FLAG_KEEP_FILES;
 			break;
+		case 'c':
+			control.flags |= FLAG_STDOUT | FLAG_KEEP_FILES;
+			break;
+		case 'N':
+			control.flags |= FLAG_DIRECT;
+			break;
+		case 'B':
+			i = atoi(optarg);
+			if (i < 1 || i > MAX_BLOCK_SIZE/1024) {
+				fatal("Block size must be from 1 to %d KB\n",
+				      MAX_BLOCK_SIZE/1024);
+			}
+			control.block_size = i * 1024;
+			break;
+		case 'D':
+			control.reference = optarg;
+			break;
+		case 'F':
+			control.store_name = optarg;
+			break;
+		case 'R':
+			control.flags |= FLAG_RSYNCABLE;
+			break;
+		case 'A':
+			i = atoi(optarg);
+			if (i < 0 || i > MAX_READAHEAD_MB) {
+				fatal("Read ahead must be from 0 to %d MB\n",
+				      MAX_READAHEAD_MB);
+			}
+			control.readahead_mb = i;
+			break;
+		case 'p':
+			i = atoi(optarg);
+			if (i < 1 || i > MAX_THREADS) {
+				fatal("Threads must be from 1 to %d\n", MAX_THREADS);
+			}
+			control.threads = i;
+			break;
+		case 'U':
+			i = atoi(optarg);
+			if (i < 1) {
+				fatal("Queue length must be at least 1 block\n");
+			}
+			control.max_queued = i;
+			break;
+		case 'C':
+			control.codec = codec_type(optarg);
+			if (control.codec == -1) {
+				err_msg("Unknown codec %s - this rzip supports ", optarg);
+				codec_list(stderr);
+				fatal("\n");
+			}
+			break;
 		case 't':
-			fatal("integrity checking currently not implemented\n");
 			control.flags |= FLAG_TEST_ONLY;
 			break;
 		case 'f':
@@ -432,7 +604,8 @@ static void compress_file(struct rzip_control *control)
 		fatal("Cannot specify output filename with more than 1 file\n");
 	}
 	
-	if (!control.outname && control.in_tmp && ! control.out_tmp) {
+	if (!control.outname && control.in_tmp && ! control.out_tmp &&
+	    !(control.flags & FLAG_STDOUT)) {
 		fatal("Must specify output filename when reading from stdin\n");
 	}
 	
@@ -447,6 +620,38 @@ static void compress_file(struct rzip_control *control)
 	if (control.in_tmp)
 		argc=1;
 
+	if (control.flags & FLAG_STDOUT) {
+		if (control.flags & FLAG_TEST_ONLY) {
+			fatal("Cannot use -c with -t\n");
+		}
+		if (control.outname || control.out_tmp) {
+			fatal("Cannot use -c with -o or -Q\n");
+		}
+		if (argc > 1) {
+			fatal("Cannot write more than 1 file to stdout\n");
+		}
+		/* anything rzip reports would land in the archive */
+		control.verbosity = 0;
+		control.flags &= ~FLAG_SHOW_PROGRESS;
+	}
+
+	if (control.store_name && (control.out_tmp || (control.flags & FLAG_STDOUT)) &&
+	    !(control.flags & FLAG_DECOMPRESS)) {
+		fatal("Cannot use a fingerprint store when writing to stdout\n");
+	}
+
+	if (control.store_name) {
+		control.store = store_open(&control, control.store_name);
+	}
+
+	if (control.reference) {
+		control.fd_ref = open(control.reference, O_RDONLY);
+		if (control.fd_ref == -1) {
+			fatal("Failed to open reference file %s: %s\n",
+			      control.reference, strerror(errno));
+		}
+	}
+
 	if (argc < 1) {
 		usage();
 		exit(1);
@@ -458,6 +663,17 @@ static void compress_file(struct rzip_control *control)
 		else
 			control.infile = argv[i];
 
+		/* a plain "-" compresses stdin through memory, no -q
+		   needed, and decompresses archives written with -c */
+		control.flags &= ~FLAG_STDIN;
+		if (!control.in_tmp && strcmp(control.infile, "-") == 0) {
+			if (!control.outname && !control.out_tmp &&
+			    !(control.flags & (FLAG_STDOUT | FLAG_TEST_ONLY))) {
+				fatal("Must specify output filename when reading from stdin\n");
+			}
+			control.flags |= FLAG_STDIN;
+		}
+
 		if (control.flags & (FLAG_DECOMPRESS | FLAG_TEST_ONLY)) {
 			decompress_file(&control);
 		} else {
@@ -465,5 +681,9 @@ static void compress_file(struct rzip_control *control)
 		}
 	}
 
+	if (control.store) {
+		store_close(control.store);
+	}
+
 	return 0;
 }
@@ -25,6 +25,7 @@
 #include <netinet/in.h>
 
 #define u32 uint32
+#define uint64 uint64_t
 
 static inline u32 lshift(u32 x, unsigned int s)
 {
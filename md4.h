@@ -7,7 +7,9 @@
 #define MD4_BLOCK_WORDS		16
 #define MD4_HASH_WORDS		4
 
+#ifndef uchar
 typedef unsigned char uchar;
+#endif
 
 struct md4_ctx {
 	uint32_t hash[MD4_HASH_WORDS];
@@ -0,0 +1,146 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* memory policy - how the big tables and chunk maps are backed, and
+   the paging hints given to the kernel for them */
+
+#include "rzip.h"
+#include <sys/resource.h>
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define WRITEBACK_WINDOW (8*1024*1024)
+
+static size_t page_size(void)
+{
+	static size_t size;
+	if (!size) size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+/* allocate a big zeroed region - a table that is going to be probed
+   at random, or an in-memory chunk window. Try explicit huge pages
+   first, then ask for transparent ones, so that a 64MB hash table
+   needs a few dozen TLB entries rather than thousands. Returns NULL
+   on failure */
+void *mem_alloc(size_t size)
+{
+	void *p;
+
+#ifdef MAP_HUGETLB
+	if (size >= HUGE_PAGE_SIZE && size % HUGE_PAGE_SIZE == 0) {
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) return p;
+	}
+#endif
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+
+#ifdef MADV_HUGEPAGE
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+void mem_free(void *p, size_t size)
+{
+	munmap(p, size);
+}
+
+/* hint that [p, p+len) of a mapping is about to be read */
+void mem_willneed(uchar *p, size_t len)
+{
+	uchar *start = (uchar *)((unsigned long)p & ~(page_size()-1));
+
+	madvise(start, len + (p - start), MADV_WILLNEED);
+}
+
+/* drop the pages wholly inside [lo, hi) of a file backed mapping.
+   They stay in the page cache, so touching them again only costs a
+   minor fault. Never use this on anonymous memory, which it zeroes */
+void mem_dontneed(uchar *lo, uchar *hi)
+{
+	unsigned long start, end;
+
+	start = ((unsigned long)lo + page_size()-1) & ~(page_size()-1);
+	end = (unsigned long)hi & ~(page_size()-1);
+	if (end > start) {
+		madvise((void *)start, end - start, MADV_DONTNEED);
+	}
+}
+
+/* start reading [offset, offset+len) of a file into the page cache
+   without waiting for it */
+void file_willneed(int fd, off_t offset, off_t len)
+{
+	if (len > 0) {
+		posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+	}
+}
+
+/* drop the clean pages of [offset, offset+len) of a file from the
+   page cache, for --direct */
+void file_dontneed(int fd, off_t offset, off_t len)
+{
+	if (len > 0) {
+		posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+	}
+}
+
+/* keep the dirty pages of a file being written from piling up, for
+   --direct. Every window written up to pos is queued for writeback as
+   soon as it is complete, and with drop the window before it is waited
+   for and dropped from the page cache. *mark is where the next window
+   starts */
+void file_writeback(int fd, off_t *mark, off_t pos, int drop)
+{
+	while (pos - *mark >= WRITEBACK_WINDOW) {
+#ifdef SYNC_FILE_RANGE_WRITE
+		sync_file_range(fd, *mark, WRITEBACK_WINDOW,
+				SYNC_FILE_RANGE_WRITE);
+		if (drop && *mark >= WRITEBACK_WINDOW) {
+			file_drop(fd, *mark - WRITEBACK_WINDOW, *mark);
+		}
+#endif
+		*mark += WRITEBACK_WINDOW;
+	}
+}
+
+/* write back [start, end) of a file, wait for it and drop it from the
+   page cache, for --direct */
+void file_drop(int fd, off_t start, off_t end)
+{
+	if (end <= start) return;
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, start, end - start,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+	file_dontneed(fd, start, end - start);
+}
+
+/* print the page faults taken so far */
+void mem_report(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0) return;
+	printf("page faults: major=%ld minor=%ld\n",
+	       ru.ru_majflt, ru.ru_minflt);
+}
@@ -0,0 +1,136 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* micro-benchmark for the control record encoder. Encodes the same
+   run of match records into stream 0 a byte at a time through
+   write_stream() and then directly with stream_space(), and reports
+   records per second for each. The two outputs must be identical.
+
+   usage: recbench [records]
+*/
+
+#include "rzip.h"
+#include <sys/time.h>
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+static void put_byte(void *ss, uchar b)
+{
+	if (write_stream(ss, 0, &b, 1) != 0) fatal(NULL);
+}
+
+static void encode_bytewise(void *ss, uchar head, int len, uint32 ofs)
+{
+	put_byte(ss, head);
+	put_byte(ss, len & 0xFF);
+	put_byte(ss, (len>>8) & 0xFF);
+	put_byte(ss, ofs & 0xFF);
+	put_byte(ss, (ofs>>8) & 0xFF);
+	put_byte(ss, (ofs>>16) & 0xFF);
+	put_byte(ss, (ofs>>24) & 0xFF);
+}
+
+static void encode_direct(void *ss, uchar head, int len, uint32 ofs)
+{
+	uchar rec[7];
+	uchar *p = stream_space(ss, 0, 7);
+
+	if (!p) p = rec;
+	p[0] = head;
+	p[1] = len & 0xFF;
+	p[2] = (len>>8) & 0xFF;
+	p[3] = ofs & 0xFF;
+	p[4] = (ofs>>8) & 0xFF;
+	p[5] = (ofs>>16) & 0xFF;
+	p[6] = (ofs>>24) & 0xFF;
+	if (p == rec && write_stream(ss, 0, rec, 7) != 0) fatal(NULL);
+}
+
+static double run(const char *name, int fd, long n,
+		  void (*encode)(void *, uchar, int, uint32))
+{
+	struct rzip_control control;
+	void *ss;
+	double t;
+	long i;
+
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+		fatal("Failed to reset output - %s\n", strerror(errno));
+	}
+
+	/* level 0 stores the blocks, so only the encoder is timed */
+	memset(&control, 0, sizeof(control));
+	ss = open_stream_out(&control, fd, NUM_STREAMS, 0, 0);
+	if (!ss) fatal(NULL);
+
+	t = now();
+	for (i=0;i<n;i++) {
+		encode(ss, 1, 3 + (i & 0x3FF), (uint32)(i * 2654435761U) >> 8);
+	}
+	t = now() - t;
+
+	if (close_stream_out(ss) != 0) fatal(NULL);
+
+	printf("%-10s %8.1f Mrecords/s\n", name, n / t / 1.0e6);
+	return t;
+}
+
+static void compare(int fd1, int fd2)
+{
+	static uchar b1[64*1024], b2[64*1024];
+	ssize_t n1, n2;
+
+	lseek(fd1, 0, SEEK_SET);
+	lseek(fd2, 0, SEEK_SET);
+	do {
+		n1 = read(fd1, b1, sizeof(b1));
+		n2 = read(fd2, b2, sizeof(b2));
+		if (n1 != n2 || (n1 > 0 && memcmp(b1, b2, n1) != 0)) {
+			fatal("encoders produced different output\n");
+		}
+	} while (n1 > 0);
+}
+
+int main(int argc, char *argv[])
+{
+	char t1[] = "recbench.XXXXXX", t2[] = "recbench.XXXXXX";
+	long n = 20*1000*1000;
+	double tb, td;
+	int fd1, fd2;
+
+	if (argc > 1) n = atol(argv[1]);
+
+	fd1 = mkstemp(t1);
+	fd2 = mkstemp(t2);
+	if (fd1 == -1 || fd2 == -1) {
+		fatal("Failed to create temporary files - %s\n", strerror(errno));
+	}
+	unlink(t1);
+	unlink(t2);
+
+	tb = run("bytewise", fd1, n, encode_bytewise);
+	td = run("direct", fd2, n, encode_direct);
+	compare(fd1, fd2);
+
+	printf("speedup    %8.2fx for %ld records\n", tb / td, n);
+	return 0;
+}
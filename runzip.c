@@ -19,99 +19,381 @@
 
 #include "rzip.h"
 
-static inline uchar read_u8(void *ss, int stream)
+/* the control records are parsed in place in the stream buffers. A
+   cursor walks what is left of the current block of one stream */
+struct cursor {
+	void *ss;
+	int stream;
+	uchar *p, *end;
+};
+
+static void cur_fill(struct cursor *c)
 {
-	uchar b;
-	if (read_stream(ss, stream, &b, 1) != 1) {
+	int n = 0;
+
+	c->p = stream_take(c->ss, c->stream, &n);
+	if (!c->p || n == 0) {
 		fatal("Stream read failed\n");
 	}
-	return b;
+	c->end = c->p + n;
 }
 
-static inline unsigned read_u16(void *ss, int stream)
+static inline uchar cur_u8(struct cursor *c)
 {
-	unsigned ret;
-	ret = read_u8(ss, stream);
-	ret |= read_u8(ss, stream)<<8;
-	return ret;
+	if (c->p == c->end) cur_fill(c);
+	return *c->p++;
 }
 
-static inline unsigned read_u32(void *ss, int stream)
+/* a field of a control record: a varint with MAGIC_VARINT, otherwise
+   width bytes little endian */
+static inline uint64_t cur_field(struct cursor *c, int varint, int width)
 {
-	unsigned ret;
-	ret = read_u8(ss, stream);
-	ret |= read_u8(ss, stream)<<8;
-	ret |= read_u8(ss, stream)<<16;
-	ret |= read_u8(ss, stream)<<24;
-	return ret;
+	uint64_t v = 0;
+	int i, shift;
+	uchar b;
+
+	if (!varint) {
+		for (i=0;i<width;i++) {
+			v |= (uint64_t)cur_u8(c) << (8*i);
+		}
+		return v;
+	}
+
+	for (shift = 0; ; shift += 7) {
+		b = cur_u8(c);
+		if (shift > 63) {
+			fatal("Corrupt control record in stream %d\n", c->stream);
+		}
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) break;
+	}
+	return v;
 }
 
-static inline unsigned read_u24(void *ss, int stream)
+/* records may cover more than any sensible buffer, so the data is
+   moved in pieces of at most this size */
+#define UNZIP_PIECE (1024*1024)
+
+/* where the output file can be mapped, a chunk is built in a shared
+   mapping of it, so that a match is a copy from earlier in the
+   mapping and the other records read their data straight into place,
+   with no system calls at all. The file is extended a step ahead of
+   the output, and the mapping moved to cover it */
+#define WINDOW_STEP (64*1024*1024)
+
+/* output going to stdout is built in anonymous memory instead, which
+   holds the whole chunk as history for the matches, and is handed on
+   in pieces of at least this size */
+#define PIPE_FLUSH (1024*1024)
+
+struct window {
+	int fd;
+	int active;
+	int anon;
+	off_t start;
+	uchar *map;
+	size_t delta;
+	size_t size;
+	size_t len;
+	size_t sent;
+};
+
+/* write out what an anonymous window has built since the last time */
+static void window_flush(struct window *w)
 {
-	unsigned ret;
-	ret = read_u8(ss, stream);
-	ret |= read_u8(ss, stream)<<8;
-	ret |= read_u8(ss, stream)<<16;
-	return ret;
+	ssize_t n;
+
+	while (w->sent < w->len) {
+		n = write(w->fd, w->map + w->sent, w->len - w->sent);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) {
+			fatal("Failed to write %lu bytes to stdout - %s\n",
+			      (unsigned long)(w->len - w->sent),
+			      n ? strerror(errno) : "nothing written");
+		}
+		w->sent += n;
+	}
 }
 
+/* unmap the window, leaving the file and its position at the end of
+   the output so far */
+static void window_close(struct window *w)
+{
+	if (!w->active) return;
+	if (w->anon) {
+		window_flush(w);
+		munmap(w->map, w->size);
+		w->map = NULL;
+		w->active = 0;
+		return;
+	}
+	if (w->map) {
+		munmap(w->map, w->delta + w->size);
+		w->map = NULL;
+	}
+	w->active = 0;
+	if (ftruncate(w->fd, w->start + w->len) != 0 ||
+	    lseek(w->fd, w->start + w->len, SEEK_SET) == (off_t)-1) {
+		fatal("Failed to trim output file - %s\n", strerror(errno));
+	}
+}
 
-static int read_header(void *ss, uchar *head)
+/* make the window cover at least size bytes from the start of the
+   chunk. If the file can't be extended or mapped that far the window
+   is closed and the rest of the chunk is written the old way */
+static void window_grow(struct window *w, size_t size)
 {
-	*head = read_u8(ss, 0);
-	return read_u16(ss, 0);
+#ifdef HAVE_POSIX_FALLOCATE
+	int ret;
+#endif
+	uchar *map;
+
+	/* anonymous memory is all the history there is, so it has to
+	   grow */
+	if (w->anon) {
+		if (!w->map) {
+			map = mmap(NULL, size, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#ifdef MREMAP_MAYMOVE
+		} else {
+			map = mremap(w->map, w->size, size, MREMAP_MAYMOVE);
+#else
+		} else {
+			map = mmap(NULL, size, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (map != MAP_FAILED) {
+				memcpy(map, w->map, w->len);
+				munmap(w->map, w->size);
+			}
+#endif
+		}
+		if (map == MAP_FAILED) {
+			fatal("Failed to allocate %lu bytes of history - %s\n",
+			      (unsigned long)size, strerror(errno));
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(map, size, MADV_HUGEPAGE);
+#endif
+		w->map = map;
+		w->size = size;
+		return;
+	}
+
+	/* the blocks are allocated up front, so that a full disk is an
+	   error here and not a SIGBUS on a store to the mapping */
+#ifdef HAVE_POSIX_FALLOCATE
+	ret = posix_fallocate(w->fd, w->start, size);
+	if (ret == ENOSPC) {
+		fatal("Failed to extend output file - %s\n", strerror(ret));
+	}
+	if (ret != 0 && ftruncate(w->fd, w->start + size) != 0) {
+		window_close(w);
+		return;
+	}
+#else
+	if (ftruncate(w->fd, w->start + size) != 0) {
+		window_close(w);
+		return;
+	}
+#endif
+
+	map = mmap(NULL, w->delta + size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   w->fd, w->start - w->delta);
+	if (map == MAP_FAILED) {
+		window_close(w);
+		return;
+	}
+	if (w->map) {
+		munmap(w->map, w->delta + w->size);
+	}
+	w->map = map;
+	w->size = size;
+}
+
+/* start a window at the current position of the output file, or in
+   memory for a pipe. hint is how much output the chunk is likely to
+   have, or 0 if unknown */
+static void window_open(struct window *w, int fd, off_t hint, int pipe)
+{
+	struct stat st;
+
+	w->fd = fd;
+	w->active = 0;
+	w->anon = pipe;
+	w->map = NULL;
+	w->size = w->len = w->sent = 0;
+	w->delta = 0;
+	if (pipe) {
+		w->active = 1;
+		window_grow(w, (hint > 0 && hint < WINDOW_STEP) ? hint : WINDOW_STEP);
+		return;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return;
+	w->start = lseek(fd, 0, SEEK_CUR);
+	if (w->start == (off_t)-1) return;
+	w->active = 1;
+	w->delta = w->start % sysconf(_SC_PAGESIZE);
+	window_grow(w, (hint > 0 && hint < WINDOW_STEP) ? hint : WINDOW_STEP);
+}
+
+/* the place for the next len bytes of output, or NULL if they have
+   to be written to the file */
+static uchar *window_space(struct window *w, int len)
+{
+	if (w->map && w->len + len > w->size) {
+		window_grow(w, MAX(w->len + len, 2*w->size));
+	}
+	if (!w->map) return NULL;
+	return w->map + w->delta + w->len;
 }
 
+/* account for len bytes put at p by a record */
+static int window_done(struct window *w, uchar *p, int len, uint32 *cksum)
+{
+	*cksum = crc32_buffer(p, len, *cksum);
+	w->len += len;
+	if (w->anon && w->len - w->sent >= PIPE_FLUSH) {
+		window_flush(w);
+	}
+	return len;
+}
 
-static int unzip_literal(void *ss, int len, int fd_out, uint32 *cksum, int out_is_pipe)
+static int unzip_literal(void *ss, int len, struct window *w, int fd_out,
+			 uint32 *cksum)
 {
 	uchar *buf;
-	ssize_t w,r;
+	int n, total = 0;
+
+	buf = window_space(w, len);
+	if (buf) {
+		if (read_stream(ss, STREAM_LITERALS, buf, len) != len) {
+			fatal("Stream read failed\n");
+		}
+		return window_done(w, buf, len, cksum);
+	}
 
-	buf = malloc(len);
+	buf = malloc(MIN(len, UNZIP_PIECE));
 	if (!buf) {
 		fatal("Failed to allocate literal buffer of size %d\n", len);
 	}
 
-	read_stream(ss, 1, buf, len);
-	if (write(fd_out, buf, len) != len) {
-		fatal("Failed to write literal buffer of size %d\n", len);
-	}
-	if (out_is_pipe) {
-		w=0;
-		while(w<len && (r=write(STDOUT_FILENO, buf+w, len-w))>0)
-			w+=r;
-		if(r<0)
-			fatal("Failed to write literal buffer of size %d\n", len);
-	}
+	while (len) {
+		n = MIN(len, UNZIP_PIECE);
+		if (read_stream(ss, STREAM_LITERALS, buf, n) != n) {
+			fatal("Stream read failed\n");
+		}
+		if (write(fd_out, buf, n) != n) {
+			fatal("Failed to write literal buffer of size %d\n", n);
+		}
 
-	*cksum = crc32_buffer(buf, len, *cksum);
+		*cksum = crc32_buffer(buf, n, *cksum);
+
+		len -= n;
+		total += n;
+	}
 
 	free(buf);
-	return len;
+	return total;
 }
 
-static int unzip_match(void *ss, int len, int fd_out, int fd_hist, uint32 *cksum, int out_is_pipe)
+/* copy a match of len bytes from offset bytes back. A match closer
+   than its length overlaps its own output, which then repeats every
+   offset bytes. A short pattern is built once and laid down 16 bytes
+   at a time, which compilers turn into single vector stores; a longer
+   one is copied in steps that double as the output grows, since all
+   of it from offset bytes back is the pattern repeated */
+static inline void copy_match(uchar *dst, uint32 offset, uint32 len)
+{
+	const uchar *src = dst - offset;
+	uint32 n;
+
+	if (offset >= len) {
+		memcpy(dst, src, len);
+	} else if (offset == 1) {
+		memset(dst, src[0], len);
+	} else if (offset <= 16) {
+		uchar pat[32];
+		uint32 phase = 0, step = 16 % offset;
+
+		for (n=0;n<offset+16;n++) {
+			pat[n] = src[n % offset];
+		}
+		for (n=0;n+16<=len;n+=16) {
+			memcpy(dst+n, pat+phase, 16);
+			phase += step;
+			if (phase >= offset) phase -= offset;
+		}
+		memcpy(dst+n, pat+phase, len-n);
+	} else {
+		memcpy(dst, src, offset);
+		for (n=offset;n<len;n+=MIN(len-n, n+offset)) {
+			memcpy(dst+n, src, MIN(len-n, n+offset));
+		}
+	}
+}
+
+static int unzip_match(uint32 offset, int len, struct window *w, int fd_out,
+		       int fd_hist, uint32 *cksum)
 {
-	unsigned offset;
 	int n, total=0;
-	off_t cur_pos = lseek(fd_out, 0, SEEK_CUR);
-	offset = read_u32(ss, 0);
-	ssize_t w,r;
+	off_t cur_pos;
+	uchar *buf;
+
+	buf = window_space(w, len);
+	if (buf) {
+		if (offset > w->len || offset == 0) {
+			fatal("Match offset %u outside the chunk at %lu\n",
+			      offset, (unsigned long)w->len);
+		}
+		copy_match(buf, offset, len);
+		return window_done(w, buf, len, cksum);
+	}
+
+	cur_pos = lseek(fd_out, 0, SEEK_CUR);
 
 	if (lseek(fd_hist, cur_pos-offset, SEEK_SET) == (off_t)-1) {
 		fatal("Seek failed by %d from %d on history file in unzip_match - %s\n", 
 		      offset, cur_pos, strerror(errno));
 	}
 
-	while (len) {
-		uchar *buf;
-		n = MIN(len, offset);
+	/* an overlapping match is offset bytes of history over and over,
+	   so only those are read. The pieces written are a whole number
+	   of repeats, so every one of them is the same */
+	if (offset < (uint32)len && offset <= UNZIP_PIECE) {
+		int piece = UNZIP_PIECE - UNZIP_PIECE % offset;
 
+		n = MIN(len, piece);
 		buf = malloc(n);
 		if (!buf) {
 			fatal("Failed to allocate %d bytes in unzip_match\n", n);
 		}
+		if (read(fd_hist, buf, offset) != (ssize_t)offset) {
+			fatal("Failed to read %d bytes in unzip_match\n", offset);
+		}
+		copy_match(buf+offset, offset, n-offset);
+
+		while (len) {
+			n = MIN(len, piece);
+			if (write(fd_out, buf, n) != n) {
+				fatal("Failed to write %d bytes in unzip_match\n", n);
+			}
+			*cksum = crc32_buffer(buf, n, *cksum);
+			len -= n;
+			total += n;
+		}
+
+		free(buf);
+		return total;
+	}
+
+	n = MIN(len, MIN(offset, UNZIP_PIECE));
+	buf = malloc(n);
+	if (!buf) {
+		fatal("Failed to allocate %d bytes in unzip_match\n", n);
+	}
+
+	while (len) {
+		n = MIN(len, MIN(offset, UNZIP_PIECE));
 
 		if (read(fd_hist, buf, n) != n) {
 			fatal("Failed to read %d bytes in unzip_match\n", n);
@@ -121,20 +403,101 @@ static int unzip_match(void *ss, int len, int fd_out, int fd_hist, uint32 *cksum
 			fatal("Failed to write %d bytes in unzip_match\n", n);
 		}
 
-		if (out_is_pipe) {
-			w=0;
-			while(w<n && (r=write(STDOUT_FILENO, buf+w, n-w))>0)
-				w+=r;
-			if(r<0)
-				fatal("Failed to write literal buffer of size %d\n", len);
+		*cksum = crc32_buffer(buf, n, *cksum);
+
+		len -= n;
+		total += n;
+	}
+
+	free(buf);
+	return total;
+}
+
+
+/* copy a section of the reference file given with -D */
+static int unzip_ref(off_t offset, int len, int fd_ref, struct window *w,
+		     int fd_out, uint32 *cksum)
+{
+	uchar *buf;
+	int n, total = 0;
+
+	buf = window_space(w, len);
+	if (buf) {
+		for (total=0; total<len; total+=n) {
+			n = MIN(len - total, UNZIP_PIECE);
+			if (pread(fd_ref, buf+total, n, offset+total) != n) {
+				fatal("Failed to read %d bytes at %.0f from reference file\n",
+				      n, (double)(offset+total));
+			}
+		}
+		return window_done(w, buf, len, cksum);
+	}
+
+	buf = malloc(MIN(len, UNZIP_PIECE));
+	if (!buf) {
+		fatal("Failed to allocate %d bytes in unzip_ref\n", len);
+	}
+
+	while (len) {
+		n = MIN(len, UNZIP_PIECE);
+		if (pread(fd_ref, buf, n, offset) != n) {
+			fatal("Failed to read %d bytes at %.0f from reference file\n",
+			      n, (double)offset);
 		}
+
+		if (write(fd_out, buf, n) != n) {
+			fatal("Failed to write %d bytes in unzip_ref\n", n);
+		}
+
 		*cksum = crc32_buffer(buf, n, *cksum);
 
+		offset += n;
 		len -= n;
-		free(buf);
 		total += n;
 	}
 
+	free(buf);
+	return total;
+}
+
+
+/* copy a block held by an archive in the fingerprint store (-F) */
+static int unzip_store(uint32 archive, off_t offset, int len, void *store,
+		       struct window *w, int fd_out, uint32 *cksum)
+{
+	uchar *buf;
+	int n, total = 0;
+
+	buf = window_space(w, len);
+	if (buf) {
+		for (total=0; total<len; total+=n) {
+			n = MIN(len - total, UNZIP_PIECE);
+			store_read(store, archive, offset+total, buf+total, n);
+		}
+		return window_done(w, buf, len, cksum);
+	}
+
+	buf = malloc(MIN(len, UNZIP_PIECE));
+	if (!buf) {
+		fatal("Failed to allocate %d bytes in unzip_store\n", len);
+	}
+
+	while (len) {
+		n = MIN(len, UNZIP_PIECE);
+		store_read(store, archive, offset, buf, n);
+
+		if (write(fd_out, buf, n) != n) {
+			fatal("Failed to write %d bytes in unzip_store\n", n);
+		}
+
+		*cksum = crc32_buffer(buf, n, *cksum);
+
+		offset += n;
+		len -= n;
+		total += n;
+	}
+
+	free(buf);
 	return total;
 }
 
@@ -142,18 +505,24 @@ static int unzip_match(void *ss, int len, int fd_out, int fd_hist, uint32 *cksum
 /* decompress a section of an open file. Call fatal() on error
    return the number of bytes that have been retrieved
  */
-static int runzip_chunk(int fd_in, int fd_out, int fd_hist, int out_is_pipe, int in_is_pipe)
+static int runzip_chunk(struct rzip_control *control, int fd_in, int fd_out, int fd_hist, off_t hint, int out_is_pipe, int in_is_pipe)
 {
+	struct window w;
+	struct cursor c[SPLIT_STREAMS], *types, *lens, *vals;
 	uchar head;
-	int len;
+	int i, len, varint;
+	uint32 rep[REP_OFFSETS];
+	uint64_t v;
 	struct stat st;
 	void *ss;
 	off_t ofs;
 	int total = 0;
 	uint32 good_cksum, cksum = 0;
-	int eof;
+	int eof, n = NUM_STREAMS;
+	int direct = (control->flags & FLAG_DIRECT) && !out_is_pipe;
+	off_t start = 0, mark = 0;
 	
-	if(!in_is_pipe) {
+	if(!in_is_pipe && !(control->magic_flags & MAGIC_FORWARD)) {
 		ofs = lseek(fd_in, 0, SEEK_CUR);
 		if (ofs == (off_t)-1) {
 			fatal("Failed to seek input file in runzip_fd\n");
@@ -164,26 +533,97 @@ static int runzip_chunk(int fd_in, int fd_out, int fd_hist, int out_is_pipe, int
 		}
 	}
 
-	ss = open_stream_in(fd_in, NUM_STREAMS, in_is_pipe, &eof);
+	if (control->magic_flags & MAGIC_SPLIT) {
+		n = SPLIT_STREAMS;
+	}
+
+	ss = open_stream_in(control, fd_in, n, in_is_pipe, &eof);
 	if (!ss) {
 		if(eof)
 			return 0;
 		fatal(NULL);
 	}
 
-	while ((len = read_header(ss, &head)) || head) {
+	/* with MAGIC_SPLIT the record lengths and the values that follow
+	   them come from streams of their own; otherwise all three
+	   cursors are the one on stream 0 */
+	for (i=0;i<n;i++) {
+		c[i].ss = ss;
+		c[i].stream = i;
+		c[i].p = c[i].end = NULL;
+	}
+	types = &c[STREAM_TYPES];
+	lens = vals = types;
+	if (n == SPLIT_STREAMS) {
+		lens = &c[STREAM_LENGTHS];
+		vals = &c[STREAM_OFFSETS];
+	}
+	varint = (control->magic_flags & MAGIC_VARINT) ? 1 : 0;
+	memset(rep, 0, sizeof(rep));
+
+	if (direct) {
+		start = mark = lseek(fd_out, 0, SEEK_CUR);
+	}
+	window_open(&w, fd_out, hint, out_is_pipe);
+
+	for (;;) {
+		head = cur_u8(types);
+		if (varint && head == REC_END) break;
+		len = cur_field(lens, varint, 2);
+		if (!varint && head == REC_LITERAL && len == 0) break;
+
 		switch (head) {
-		case 0:
-			total += unzip_literal(ss, len, fd_out, &cksum, out_is_pipe);
+		case REC_LITERAL:
+			total += unzip_literal(ss, len, &w, fd_out, &cksum);
+			break;
+
+		case REC_MATCH:
+			v = cur_field(vals, varint, 4);
+			if (control->magic_flags & MAGIC_REPEAT) {
+				rep_push(rep, v);
+			}
+			total += unzip_match(v, len, &w, fd_out, fd_hist, &cksum);
+			break;
+
+		case REC_REF:
+			if (!control->reference) {
+				fatal("Reference match found but no reference file given\n");
+			}
+			v = cur_field(vals, varint, 8);
+			total += unzip_ref(v, len, control->fd_ref, &w, fd_out, &cksum);
+			break;
+
+		case REC_STORE:
+			if (!control->store) {
+				fatal("Fingerprint store reference found but no store given\n");
+			}
+			v = cur_field(vals, varint, 4);
+			total += unzip_store(v, cur_field(vals, varint, 8), len,
+					     control->store, &w, fd_out, &cksum);
 			break;
 
 		default:
-			total += unzip_match(ss, len, fd_out, fd_hist, &cksum, out_is_pipe);
+			if (!(control->magic_flags & MAGIC_REPEAT) ||
+			    head >= REC_REP + REP_OFFSETS || head < REC_REP ||
+			    !rep[head - REC_REP]) {
+				fatal("Unknown record type %d\n", head);
+			}
+			v = rep_use(rep, head - REC_REP);
+			total += unzip_match(v, len, &w, fd_out, fd_hist, &cksum);
 			break;
 		}
+
+		/* matches read back anywhere in the chunk, so the output
+		   is only written back as it goes and stays cached until
+		   the chunk is done */
+		if (direct) {
+			file_writeback(fd_out, &mark, start + total, 0);
+		}
 	}
 
-	good_cksum = read_u32(ss, 0);
+	window_close(&w);
+
+	good_cksum = cur_field(vals, 0, 4);
 	if (good_cksum != cksum) {
 		fatal("Bad checksum 0x%08x - expected 0x%08x\n", cksum, good_cksum);
 	}
@@ -192,11 +632,8 @@ static int runzip_chunk(int fd_in, int fd_out, int fd_hist, int out_is_pipe, int
 		fatal("Failed to close stream!\n");
 	}
 
-	if(out_is_pipe) {
-		if(lseek(fd_out,0,SEEK_SET)==-1 ||
-		   lseek(fd_hist,0,SEEK_SET)==-1 ||
-		   ftruncate(fd_out,0)==-1)
-			fatal("cannot truncate temporary file\n");
+	if (direct) {
+		file_drop(fd_out, start, start + total);
 	}
 
 	return total;
@@ -205,15 +642,56 @@ static int runzip_chunk(int fd_in, int fd_out, int fd_hist, int out_is_pipe, int
 /* decompress a open file. Call fatal() on error
    return the number of bytes that have been retrieved
  */
-off_t runzip_fd(int fd_in, int fd_out, int fd_hist, off_t expected_size, int out_is_pipe, int in_is_pipe)
+off_t runzip_fd(struct rzip_control *control, int fd_in, int fd_out, int fd_hist, off_t expected_size, int out_is_pipe, int in_is_pipe)
 {
 	off_t total = 0, l;
 	while (total < expected_size || expected_size==0) {
-		l = runzip_chunk(fd_in, fd_out, fd_hist, out_is_pipe, in_is_pipe);
+		l = runzip_chunk(control, fd_in, fd_out, fd_hist,
+				 expected_size ? expected_size - total : 0,
+				 out_is_pipe, in_is_pipe);
 		total += l;
 		if( l == 0)
 			break;
 	}
+
+	if (control->verbosity > 0 && !out_is_pipe) {
+		printf("stream buffers peak %luk\n",
+		       (unsigned long)(stream_buffer_peak() >> 10));
+	}
 	return total;
 }
 
+
+/* check the blocks of every chunk of an open archive against their
+   checksums, without writing anything out. Archives from before
+   MAGIC_BLOCK_CRC can only be checked to decompress. Returns the
+   number of bad blocks */
+int verify_fd(struct rzip_control *control, int fd_in)
+{
+	int n = (control->magic_flags & MAGIC_SPLIT) ? SPLIT_STREAMS : NUM_STREAMS;
+	int ret, chunks = 0, bad = 0;
+	off_t pos;
+
+	if (!(control->magic_flags & MAGIC_BLOCK_CRC)) {
+		err_msg("%s has no block checksums - only checking that it decompresses\n",
+			control->infile);
+	}
+
+	/* a pipe has been read as far as the end of the magic header */
+	pos = lseek(fd_in, 0, SEEK_CUR);
+	if (pos == (off_t)-1) {
+		pos = 24;
+	}
+
+	while ((ret = verify_stream(control, fd_in, n, &pos, &bad)) == 0) {
+		chunks++;
+	}
+	if (ret == -1) {
+		err_msg("Could not find the blocks of chunk %d\n", chunks + 1);
+	}
+
+	if (control->verbosity > 0) {
+		printf("%d chunks, %d bad blocks\n", chunks, bad);
+	}
+	return bad;
+}
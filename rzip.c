@@ -24,8 +24,26 @@
 
 #define CHUNK_MULTIPLE 100*1024*1024
 #define CKSUM_CHUNK 1024*1024
+#define WILLNEED_WINDOW 8*1024*1024
 #define GREAT_MATCH 1024
 #define MINIMUM_MATCH 31
+/* shorter repeat matches only take bytes the backend would have
+   compressed well anyway */
+#define REP_MINIMUM MINIMUM_MATCH
+
+/* content defined blocks looked up in the fingerprint store (-F) */
+#define STORE_MIN_BLOCK 16*1024
+#define STORE_MAX_BLOCK 256*1024
+#define STORE_BLOCK_BITS 16
+
+/* --rsyncable: the stream buffers are flushed at content defined
+   points of the input, and a chunk ends at a content defined point
+   within the last RSYNC_CHUNK_WINDOW bytes of its nominal size */
+#define RSYNC_MIN_BLOCK 128*1024
+#define RSYNC_MAX_BLOCK 4*1024*1024
+#define RSYNC_BLOCK_BITS 18
+#define RSYNC_CHUNK_WINDOW 16*1024*1024
+#define RSYNC_CHUNK_BITS 20
 
 /* Hash table works as follows.  We start by throwing tags at every
  * offset into the table.  As it fills, we start eliminating tags
@@ -41,6 +59,23 @@ struct hash_entry {
 	tag t;
 };
 
+/* The reference file (-D) is indexed once, up front, into a separate
+ * table.  Offsets are absolute within the reference file, which may
+ * be larger than a chunk, and the table is never cleaned. */
+struct ref_entry {
+	off_t offset;
+	tag t;
+};
+
+/* A block of the chunk that an archive in the fingerprint store
+ * already holds. */
+struct dup_block {
+	uint32 start;
+	uint32 len;
+	uint32 archive;
+	off_t offset;
+};
+
 /* Levels control hashtable size and bzip2 level. */
 static const struct level {
 	unsigned bzip_level;
@@ -61,9 +96,21 @@ static const struct level {
 };
 
 
+/* the stream buffer size a level uses when -B is not given */
+uint32 level_block_size(unsigned level)
+{
+	return 100*1024*MAX(levels[MIN(9, level)].bzip_level, 1);
+}
+
+
 struct rzip_state {
 	struct rzip_control *control;
 	void *ss;
+	int s_len, s_ofs;
+	int varint;
+	int max_len;
+	int repeat;
+	uint32 rep[REP_OFFSETS];
 	const struct level *level;
 	tag hash_index[256];
 	struct hash_entry *hash_table;
@@ -73,39 +120,110 @@ struct rzip_state {
 	tag minimum_tag_mask;
 	unsigned int tag_clean_ptr;
 	uchar *last_match;
+	uchar *chunk_buf;
+	uchar *dropped;
+	int drop_behind;
 	uint32 cksum;
 	uint32 chunk_size;
 	int fd_in, fd_out;
+	uchar *ref_buf;
+	off_t ref_size;
+	struct ref_entry *ref_table;
+	unsigned int ref_bits;
+	tag ref_mask;
+	struct dup_block *dups;
+	unsigned int num_dups;
+	unsigned int dup_next;
+	off_t chunk_base;
+	off_t ra_offset;
+	off_t ra_len;
+	off_t ra_done;
 	struct {
 		uint32 inserts;
 		uint32 literals;
 		uint32 literal_bytes;
 		uint32 matches;
 		uint32 match_bytes;
+		uint32 rep_matches;
+		uint32 rep_match_bytes;
+		uint32 ref_matches;
+		uint32 ref_match_bytes;
+		uint32 store_refs;
+		uint32 store_ref_bytes;
 		uint32 tag_hits;
 		uint32 tag_misses;
 	} stats;
 };
 
-static inline void put_u8(void *ss, int stream, uchar b)
+/* the number of bytes put_varint() needs for v */
+static inline int varint_len(uint64_t v)
+{
+	int n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* little endian base 128, 7 bits to a byte with the top bit set on
+   all but the last */
+static inline void put_varint(uchar *p, uint64_t v)
 {
-	if (write_stream(ss, stream, &b, 1) != 0) {
+	while (v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*p = v;
+}
+
+/* encode one field of a control record straight into the stream
+   buffer: a varint with MAGIC_VARINT, otherwise width bytes little
+   endian. Only a field that would fill the buffer goes through
+   write_stream() */
+static inline void put_field(struct rzip_state *st, int stream,
+			     uint64_t v, int width)
+{
+	uchar tmp[10];
+	uchar *p;
+	int i, n;
+
+	n = st->varint ? varint_len(v) : width;
+	p = stream_space(st->ss, stream, n);
+	if (!p) p = tmp;
+
+	if (st->varint) {
+		put_varint(p, v);
+	} else {
+		for (i=0;i<width;i++) {
+			p[i] = (v >> (8*i)) & 0xFF;
+		}
+	}
+
+	if (p == tmp && write_stream(st->ss, stream, tmp, n) != 0) {
 		fatal(NULL);
 	}
 }
 
-static inline void put_u16(void *ss, int stream, unsigned s)
+/* start a control record with its type and length. The fields that
+   follow go to st->s_ofs. Classic archives keep everything together in
+   stream 0; with MAGIC_SPLIT each field goes to a stream of its own so
+   the backend sees runs of like values */
+static inline void put_record(struct rzip_state *st, uchar head, int len)
 {
-	put_u8(ss, stream, s & 0xFF);
-	put_u8(ss, stream, (s>>8) & 0xFF);
+	put_field(st, STREAM_TYPES, head, 1);
+	put_field(st, st->s_len, len, 2);
 }
 
 static inline void put_uint32(void *ss, int stream, unsigned s)
 {
-	put_u8(ss, stream, s & 0xFF);
-	put_u8(ss, stream, (s>>8) & 0xFF);
-	put_u8(ss, stream, (s>>16) & 0xFF);
-	put_u8(ss, stream, (s>>24) & 0xFF);
+	uchar b[4];
+
+	put_le32(b, s);
+	if (write_stream(ss, stream, b, 4) != 0) {
+		fatal(NULL);
+	}
 }
 
 static int tmp_in_chunk(int fd_in,int chunk)
@@ -130,23 +248,40 @@ static int tmp_in_chunk(int fd_in,int chunk)
 	return l;
 }
 
-static void put_header(void *ss, uchar head, int len)
+
+/* the slot holding a match distance in the repeat cache, or -1 */
+static inline int rep_slot(struct rzip_state *st, uint32 ofs)
 {
-	put_u8(ss, 0, head);
-	put_u16(ss, 0, len);
-}
+	int i;
 
+	for (i=0;st->repeat && i<REP_OFFSETS && st->rep[i];i++) {
+		if (st->rep[i] == ofs) return i;
+	}
+	return -1;
+}
 
 static void put_match(struct rzip_state *st, uchar *p, uchar *buf, uint32 offset, int len)
 {
 	do {
 		unsigned ofs;
-		int n = len;
-		if (n > 0xFFFF) n = 0xFFFF;
+		int n = MIN(len, st->max_len);
+
+		int i;
 
 		ofs = (uint32)(p - (buf+offset));
-		put_header(st->ss, 1, n);
-		put_uint32(st->ss, 0, ofs);
+
+		/* a distance in the repeat cache is sent as its slot */
+		i = rep_slot(st, ofs);
+		if (i != -1) {
+			put_record(st, REC_REP + i, n);
+			rep_use(st->rep, i);
+			st->stats.rep_matches++;
+			st->stats.rep_match_bytes += n;
+		} else {
+			put_record(st, REC_MATCH, n);
+			put_field(st, st->s_ofs, ofs, 4);
+			if (st->repeat) rep_push(st->rep, ofs);
+		}
 
 		st->stats.matches++;
 		st->stats.match_bytes += n;
@@ -156,18 +291,54 @@ static void put_match(struct rzip_state *st, uchar *p, uchar *buf, uint32 offset
 	} while (len);
 }
 
+/* a match against the reference file carries an absolute 64 bit
+   offset into that file rather than a distance back into the chunk */
+static void put_ref_match(struct rzip_state *st, off_t offset, int len)
+{
+	do {
+		int n = MIN(len, st->max_len);
+
+		put_record(st, REC_REF, n);
+		put_field(st, st->s_ofs, offset, 8);
+
+		st->stats.ref_matches++;
+		st->stats.ref_match_bytes += n;
+		len -= n;
+		offset += n;
+	} while (len);
+}
+
+/* a block held by an archive in the fingerprint store, named by the
+   archive's number in the store and the offset within its contents */
+static void put_store_ref(struct rzip_state *st, uint32 archive, off_t offset, int len)
+{
+	do {
+		int n = MIN(len, st->max_len);
+
+		put_record(st, REC_STORE, n);
+		put_field(st, st->s_ofs, archive, 4);
+		put_field(st, st->s_ofs, offset, 8);
+
+		st->stats.store_refs++;
+		st->stats.store_ref_bytes += n;
+		len -= n;
+		offset += n;
+	} while (len);
+
+	st->control->magic_flags |= MAGIC_STORE;
+}
+
 static void put_literal(struct rzip_state *st, uchar *last, uchar *p)
 {
 	do {
-		int len = (int)(p - last);
-		if (len > 0xFFFF) len = 0xFFFF;
+		int len = (int)MIN(p - last, st->max_len);
 
 		st->stats.literals++;
 		st->stats.literal_bytes += len;
 
-		put_header(st->ss, 0, len);
+		put_record(st, REC_LITERAL, len);
 
-		if (len && write_stream(st->ss, 1, last, len) != 0) {
+		if (len && write_stream(st->ss, STREAM_LITERALS, last, len) != 0) {
 			fatal(NULL);
 		}
 		last += len;
@@ -262,6 +433,36 @@ static void insert_hash(struct rzip_state *st, tag t, uint32 offset)
 	st->hash_table[h].offset = offset;
 }
 
+/* Nothing below the lowest offset left in the hash table (or the last
+   match) can start a match any more, so let the kernel unmap the part
+   of the chunk behind it. Called once per sweep of the hash table */
+static void drop_behind(struct rzip_state *st)
+{
+	uint32 low = st->last_match - st->chunk_buf;
+	unsigned int h;
+
+	for (h = 0; h < (1<<st->hash_bits); h++) {
+		if (!empty_hash(st, h) && st->hash_table[h].offset < low)
+			low = st->hash_table[h].offset;
+	}
+
+	/* leave room for matches to be extended backwards a little */
+	if (low < GREAT_MATCH)
+		return;
+	low -= GREAT_MATCH;
+
+	if (st->chunk_buf + low > st->dropped) {
+		mem_dontneed(st->dropped, st->chunk_buf + low);
+		/* once unmapped the pages can leave the page cache too */
+		if (st->control->flags & FLAG_DIRECT) {
+			file_dontneed(st->fd_in,
+				      st->chunk_base + (st->dropped - st->chunk_buf),
+				      (st->chunk_buf + low) - st->dropped);
+		}
+		st->dropped = st->chunk_buf + low;
+	}
+}
+
 /* Eliminate one hash entry with minimum number of lower bits set.
    Returns tag requirement for any new entries. */
 static tag clean_one_from_hash(struct rzip_state *st)
@@ -291,6 +492,8 @@ again:
 	/* We hit the end: everthing in hash satisfies the better mask. */
 	st->minimum_tag_mask = better_than_min;
 	st->tag_clean_ptr = 0;
+	if (st->drop_behind)
+		drop_behind(st);
 	goto again;
 }
 
@@ -342,6 +545,53 @@ static inline int match_len(struct rzip_state *st,
 	return len;
 }
 
+/* try the distances in the repeat cache at p. Structured data often
+   repeats at the same distance again and again, and the sampled tags
+   only find such a match some way in, if at all. Returns the length of
+   the longest, with its start like find_best_match() */
+static int find_rep_match(struct rzip_state *st, uchar *p, uchar *buf,
+			  uchar *end, uint32 *offset, int *reverse)
+{
+	uchar *start = MAX(buf, st->last_match);
+	int i, length = 0;
+
+	(*reverse) = 0;
+
+	for (i=0;i<REP_OFFSETS && st->rep[i];i++) {
+		uint32 d = st->rep[i];
+		uchar *op, *p0;
+		int len, rev;
+
+		if (d > (uint32)(p - buf)) continue;
+
+		op = p - d;
+		if (p[0] != op[0] || p[REP_MINIMUM-1] != op[REP_MINIMUM-1])
+			continue;
+
+		p0 = p;
+		while (p0 < end && *p0 == *op) {
+			p0++; op++;
+		}
+		len = p0 - p;
+
+		op = p - d;
+		p0 = p;
+		while (p0 > start && op > buf && op[-1] == p0[-1]) {
+			op--; p0--;
+		}
+		rev = p - p0;
+		len += rev;
+
+		if (len >= REP_MINIMUM && len > length) {
+			length = len;
+			(*offset) = (uint32)(p0 - d - buf);
+			(*reverse) = rev;
+		}
+	}
+
+	return length;
+}
+
 static int find_best_match(struct rzip_state *st,
 			   tag t, uchar *p, uchar *buf, uchar *end, 
 			   uint32 *offset, int *reverse, int current_len)
@@ -383,6 +633,130 @@ static int find_best_match(struct rzip_state *st,
 	return length;
 }
 
+/* every sampled tag has the low ref_mask bits set, so mix the tag
+   rather than masking it to spread entries over the whole table */
+static unsigned int ref_hash(struct rzip_state *st, tag t)
+{
+	return (uint32)(t * 0x9E3779B1U) >> (32 - st->ref_bits);
+}
+
+/* look for a match of p in the reference file. The match is extended
+   backwards no further than the last match in the chunk */
+static int find_ref_match(struct rzip_state *st, tag t, uchar *p, uchar *buf,
+			  uchar *end, off_t *offset, int *reverse)
+{
+	int length = 0;
+	unsigned int h;
+	uchar *ref_end = st->ref_buf + st->ref_size;
+	uchar *start = buf;
+
+	if (start < st->last_match) start = st->last_match;
+
+	(*reverse) = 0;
+
+	for (h = ref_hash(st, t);
+	     st->ref_table[h].offset || st->ref_table[h].t;
+	     h = (h + 1) & ((1 << st->ref_bits) - 1)) {
+		uchar *op, *p0;
+		int len, rev;
+
+		if (st->ref_table[h].t != t)
+			continue;
+
+		op = st->ref_buf + st->ref_table[h].offset;
+		p0 = p;
+		while (p0 < end && op < ref_end && *p0 == *op) {
+			p0++; op++;
+		}
+		len = p0 - p;
+
+		op = st->ref_buf + st->ref_table[h].offset;
+		p0 = p;
+		while (p0 > start && op > st->ref_buf && op[-1] == p0[-1]) {
+			op--; p0--;
+		}
+		rev = p - p0;
+		len += rev;
+
+		if (len < MINIMUM_MATCH) {
+			st->stats.tag_misses++;
+			continue;
+		}
+		st->stats.tag_hits++;
+
+		if (len > length) {
+			length = len;
+			(*offset) = st->ref_table[h].offset - rev;
+			(*reverse) = rev;
+		}
+	}
+
+	return length;
+}
+
+/* split the chunk into content defined blocks and find the ones the
+   fingerprint store already holds. The rest are remembered so that
+   they can be added to the store once the archive is complete */
+static void find_dups(struct rzip_state *st, uchar *buf)
+{
+	uint32 pos = 0;
+
+	st->num_dups = 0;
+	st->dup_next = 0;
+
+	while (pos < st->chunk_size) {
+		struct dup_block *d;
+		uint32 archive;
+		off_t offset;
+		int n;
+
+		n = cdc_block(buf+pos, st->chunk_size-pos, STORE_MIN_BLOCK,
+			      STORE_MAX_BLOCK, STORE_BLOCK_BITS);
+
+		if (n < STORE_MIN_BLOCK ||
+		    !store_lookup(st->control->store, buf+pos, n,
+				  st->chunk_base+pos, &archive, &offset)) {
+			pos += n;
+			continue;
+		}
+
+		st->dups = Realloc(st->dups, (st->num_dups+1) * sizeof(st->dups[0]));
+		if (!st->dups) {
+			fatal("Failed to allocate duplicate block list\n");
+		}
+		d = &st->dups[st->num_dups++];
+		d->start = pos;
+		d->len = n;
+		d->archive = archive;
+		d->offset = offset;
+		pos += n;
+	}
+}
+
+/* emit the next duplicate block, less any part of it already covered
+   by a match. Returns the new scan position */
+static uchar *put_dup(struct rzip_state *st, uchar *buf)
+{
+	struct dup_block *d = &st->dups[st->dup_next++];
+	uchar *p = buf + d->start;
+	uchar *end = p + d->len;
+	off_t offset = d->offset;
+
+	if (st->last_match >= end)
+		return st->last_match;
+
+	if (st->last_match > p) {
+		offset += st->last_match - p;
+		p = st->last_match;
+	}
+
+	if (st->last_match < p)
+		put_literal(st, st->last_match, p);
+	put_store_ref(st, d->archive, offset, end - p);
+	st->last_match = end;
+	return end;
+}
+
 static void show_distrib(struct rzip_state *st)
 {
 	int i;
@@ -405,17 +779,33 @@ static void show_distrib(struct rzip_state *st)
 	       primary*100.0/total);
 }
 
+/* read the start of the next chunk in the background, keeping pace
+   with the scan of this one so it is in memory by the time we get there */
+static void read_ahead(struct rzip_state *st, uchar *p, uchar *buf)
+{
+	off_t want = st->ra_len * ((double)(p - buf) / st->chunk_size);
+
+	want = MIN(st->ra_len, want + WILLNEED_WINDOW);
+	if (want > st->ra_done) {
+		file_willneed(st->fd_in, st->ra_offset + st->ra_done,
+			      want - st->ra_done);
+		st->ra_done = want;
+	}
+}
+
 static void hash_search(struct rzip_state *st, uchar *buf, 
 			double pct_base, double pct_multiple)
 {
-	uchar *p, *end;
+	uchar *p, *end, *sync, *ahead;
 	tag t = 0;
 	uint32 cksum_limit = 0;
 	int pct, lastpct=0;
 	struct {
 		uchar *p;
 		uint32 ofs;
+		off_t ref_ofs;
 		int len;
+		int ref;
 	} current;
 	tag tag_mask = (1 << st->level->initial_freq)-1;
 
@@ -435,8 +825,8 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 
 		/* 66% full at max. */
 		st->hash_limit = (1<<st->hash_bits)/3 * 2;
-		st->hash_table = calloc(sizeof(st->hash_table[0]),
-					(1<<st->hash_bits));
+		st->hash_table = mem_alloc(sizeof(st->hash_table[0]) <<
+					     st->hash_bits);
 	}
 
 	if (!st->hash_table) {
@@ -445,15 +835,27 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 
 	st->minimum_tag_mask = tag_mask;
 	st->tag_clean_ptr = 0;
+	memset(st->rep, 0, sizeof(st->rep));
 	st->cksum = 0;
 	st->hash_count = 0;
 
 	p = buf;
 	end = buf + st->chunk_size - MINIMUM_MATCH;
 	st->last_match = p;
+	st->chunk_buf = buf;
+	st->dropped = buf;
+	ahead = buf;
 	current.len = 0;
 	current.p = p;
 	current.ofs = 0;
+	current.ref_ofs = 0;
+	current.ref = 0;
+
+	sync = buf + st->chunk_size;
+	if (st->control->flags & FLAG_RSYNCABLE) {
+		sync = buf + cdc_block(buf, st->chunk_size, RSYNC_MIN_BLOCK,
+				       RSYNC_MAX_BLOCK, RSYNC_BLOCK_BITS);
+	}
 
 	t = full_tag(st, p);
 
@@ -462,8 +864,47 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 		int mlen, reverse;
 
 		p++;
+
+		/* a match still being extended is dropped at a
+		   duplicate block; it started at most MINIMUM_MATCH
+		   bytes back */
+		if (st->dup_next < st->num_dups &&
+		    p >= buf + st->dups[st->dup_next].start) {
+			p = put_dup(st, buf);
+			current.p = p;
+			current.len = 0;
+			current.ref = 0;
+			if (p < end)
+				t = full_tag(st, p);
+			continue;
+		}
+
 		t = next_tag(st, p, t);
 
+		if (st->repeat && current.len == 0) {
+			mlen = find_rep_match(st, p, buf, end,
+					      &offset, &reverse);
+			if (mlen) {
+				current.p = p - reverse;
+				current.len = mlen;
+				current.ofs = offset;
+				current.ref = 0;
+			}
+		}
+
+		if (st->ref_table && (t & st->ref_mask) == st->ref_mask) {
+			off_t ref_ofs;
+
+			mlen = find_ref_match(st, t, p, buf, end,
+					      &ref_ofs, &reverse);
+			if (mlen > current.len) {
+				current.p = p - reverse;
+				current.len = mlen;
+				current.ref_ofs = ref_ofs;
+				current.ref = 1;
+			}
+		}
+
 		/* Don't look for a match if there are no tags with
 		   this number of bits in the hash table. */
 		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
@@ -485,19 +926,41 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 			current.p = p - reverse;
 			current.len = mlen;
 			current.ofs = offset;
+			current.ref = 0;
 		}
 
 		if ((current.len >= GREAT_MATCH || p>=current.p+MINIMUM_MATCH)
 		    && current.len >= MINIMUM_MATCH) {
 			if (st->last_match < current.p)
 				put_literal(st, st->last_match, current.p);
-			put_match(st, current.p, buf, current.ofs, current.len);
+			if (current.ref)
+				put_ref_match(st, current.ref_ofs, current.len);
+			else
+				put_match(st, current.p, buf, current.ofs, current.len);
 			st->last_match = current.p + current.len;
 			current.p = p = st->last_match;
 			current.len = 0;
+			current.ref = 0;
 			t = full_tag(st, p);
 		}
 
+		/* literals are only written out ahead of a match, so cut
+		   them here too. Wait for any match being extended */
+		if (p >= sync && current.len == 0) {
+			if (st->last_match < p) {
+				put_literal(st, st->last_match, p);
+				st->last_match = p;
+			}
+			if (flush_stream(st->ss) != 0) {
+				fatal("Failed to flush streams in hash_search\n");
+			}
+			while (sync <= p) {
+				sync += cdc_block(sync, buf + st->chunk_size - sync,
+						  RSYNC_MIN_BLOCK, RSYNC_MAX_BLOCK,
+						  RSYNC_BLOCK_BITS);
+			}
+		}
+
 		if ((st->control->flags & FLAG_SHOW_PROGRESS) && (p-buf) % 100 == 0) {
 			pct = pct_base + (pct_multiple * (100.0*(p-buf))/st->chunk_size);
 			if (pct != lastpct) {
@@ -511,11 +974,21 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 			}
 		}
 
-		if ((p-buf) > cksum_limit) {
-			int n = st->chunk_size - (p-buf);
+		while ((p-buf) > cksum_limit) {
+			int n = MIN(CKSUM_CHUNK, st->chunk_size - cksum_limit);
 			st->cksum = crc32_buffer(buf+cksum_limit, n, st->cksum);
 			cksum_limit += n;
 		}
+
+		/* keep the kernel reading ahead of the scan */
+		if (p + WILLNEED_WINDOW > ahead &&
+		    ahead < buf + st->chunk_size) {
+			mem_willneed(ahead, MIN(WILLNEED_WINDOW,
+						buf + st->chunk_size - ahead));
+			ahead += WILLNEED_WINDOW;
+			if (st->ra_len)
+				read_ahead(st, p, buf);
+		}
 	}
 
 
@@ -523,6 +996,10 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 		show_distrib(st);
 	}
 
+	while (st->dup_next < st->num_dups) {
+		put_dup(st, buf);
+	}
+
 	if (st->last_match < buf + st->chunk_size) {
 		put_literal(st, st->last_match,buf + st->chunk_size);
 	}
@@ -533,8 +1010,12 @@ static void hash_search(struct rzip_state *st, uchar *buf,
 		cksum_limit += n;
 	}
 
-	put_literal(st, NULL,0);
-	put_uint32(st->ss, 0, st->cksum);
+	if (st->varint) {
+		put_field(st, STREAM_TYPES, REC_END, 1);
+	} else {
+		put_literal(st, NULL,0);
+	}
+	put_uint32(st->ss, st->s_ofs, st->cksum);
 }
 
 
@@ -546,27 +1027,235 @@ static void init_hash_indexes(struct rzip_state *st)
 	}
 }
 
-/* compress a chunk of an open file. Assumes that the file is able to
-   be mmap'd and is seekable */
-static void rzip_chunk(struct rzip_state *st, int fd_in, int fd_out, off_t offset, 
-		       double pct_base, double pct_multiple, int outpiped)
+/* map the reference file and throw a sample of its tags into the
+   reference table. The sampling mask is picked so the table ends up
+   at most half full */
+static void index_reference(struct rzip_state *st)
 {
-	uchar *buf;
+	struct stat s;
+	uchar *p, *end;
+	uint32 slots;
+	unsigned int count = 0, mask_bits = 0;
+	tag t;
 
-	buf = (uchar *)mmap(NULL,st->chunk_size,PROT_READ,MAP_SHARED,fd_in,offset);
-	if (buf == (uchar *)-1) {
-		fatal("Failed to map buffer in rzip_fd\n");
+	if (fstat(st->control->fd_ref, &s) != 0) {
+		fatal("Failed to stat reference file - %s\n", strerror(errno));
+	}
+	if (s.st_size <= MINIMUM_MATCH) {
+		return;
+	}
+	st->ref_size = s.st_size;
+
+	/* the whole reference is probed at random from the start */
+	st->ref_buf = (uchar *)mmap(NULL, st->ref_size, PROT_READ,
+				    MAP_SHARED|MAP_POPULATE,
+				    st->control->fd_ref, 0);
+	if (st->ref_buf == (uchar *)-1) {
+		fatal("Failed to map reference file - %s\n", strerror(errno));
+	}
+
+	slots = st->level->mb_used * (1024*1024 / sizeof(st->ref_table[0]));
+	for (st->ref_bits = 0; (1<<st->ref_bits) < slots; st->ref_bits++) ;
+
+	while ((st->ref_size >> mask_bits) > (1<<st->ref_bits)/2)
+		mask_bits++;
+	st->ref_mask = (1 << mask_bits) - 1;
+
+	st->ref_table = mem_alloc(sizeof(st->ref_table[0]) << st->ref_bits);
+	if (!st->ref_table) {
+		fatal("Failed to allocate reference table\n");
+	}
+
+	p = st->ref_buf;
+	end = st->ref_buf + st->ref_size - MINIMUM_MATCH;
+	t = full_tag(st, p);
+	while (p < end) {
+		unsigned int h, round = 0;
+
+		p++;
+		t = next_tag(st, p, t);
+		if ((t & st->ref_mask) != st->ref_mask)
+			continue;
+
+		/* keep only the first few copies of a repeated pattern */
+		for (h = ref_hash(st, t);
+		     st->ref_table[h].offset || st->ref_table[h].t;
+		     h = (h + 1) & ((1 << st->ref_bits) - 1)) {
+			if (st->ref_table[h].t == t &&
+			    ++round == st->level->max_chain_len)
+				break;
+		}
+		if (round == st->level->max_chain_len)
+			continue;
+
+		st->ref_table[h].t = t;
+		st->ref_table[h].offset = p - st->ref_buf;
+		if (++count > (1<<st->ref_bits)/3 * 2)
+			break;
+	}
+
+	if (st->control->verbosity > 1) {
+		printf("reference: %u tags from %.0f bytes, mask %u\n",
+		       count, (double)st->ref_size, st->ref_mask);
+	}
+}
+
+/* compress a chunk held in memory */
+static void compress_chunk(struct rzip_state *st, uchar *buf, int fd_out,
+			   double pct_base, double pct_multiple, int outpiped)
+{
+	if (st->control->store) {
+		find_dups(st, buf);
 	}
 
-	st->ss = open_stream_out(fd_out, NUM_STREAMS, st->level->bzip_level, outpiped);
+	/* a record covers at most this many bytes */
+	st->varint = (st->control->magic_flags & MAGIC_VARINT) ? 1 : 0;
+	st->max_len = st->varint ? 0x7FFFFFFF : 0xFFFF;
+	st->repeat = (st->control->magic_flags & MAGIC_REPEAT) ? 1 : 0;
+
+	if (st->control->magic_flags & MAGIC_SPLIT) {
+		st->s_len = STREAM_LENGTHS;
+		st->s_ofs = STREAM_OFFSETS;
+		st->ss = open_stream_out(st->control, fd_out, SPLIT_STREAMS, st->level->bzip_level, outpiped);
+		/* a record is at most 1, 2 and 12 bytes in the control
+		   streams, so cut them into smaller blocks to keep them in
+		   step with the literals. A reader of the forward format
+		   then holds less of one stream while it waits for the
+		   next block of another */
+		if (st->ss) {
+			stream_bufsize(st->ss, STREAM_TYPES, 4);
+			stream_bufsize(st->ss, STREAM_LENGTHS, 2);
+		}
+	} else {
+		st->s_len = st->s_ofs = STREAM_TYPES;
+		st->ss = open_stream_out(st->control, fd_out, NUM_STREAMS, st->level->bzip_level, outpiped);
+	}
 	if (!st->ss) {
 		fatal("Failed to open streams in rzip_fd\n");
 	}
+	stream_filter(st->ss, STREAM_LITERALS);
 	hash_search(st, buf, pct_base, pct_multiple);
 	if (close_stream_out(st->ss) != 0) {
 		fatal("Failed to flush/close streams in rzip_fd\n");
 	}
-	munmap(buf, st->chunk_size);
+}
+
+/* compress a chunk of an open file. Assumes that the file is able to
+   be mmap'd and is seekable */
+static void rzip_chunk(struct rzip_state *st, int fd_in, int fd_out, off_t offset, 
+		       double pct_base, double pct_multiple, int outpiped)
+{
+	uchar *buf, *map;
+	off_t delta;
+
+	/* with --rsyncable chunks need not start on a page boundary */
+	delta = offset % sysconf(_SC_PAGESIZE);
+	map = (uchar *)mmap(NULL,st->chunk_size+delta,PROT_READ,MAP_SHARED,fd_in,offset-delta);
+	if (map == (uchar *)-1) {
+		fatal("Failed to map buffer in rzip_fd\n");
+	}
+	buf = map + delta;
+	st->drop_behind = 1;
+
+	compress_chunk(st, buf, fd_out, pct_base, pct_multiple, outpiped);
+
+	munmap(map, st->chunk_size+delta);
+
+	if (st->control->flags & FLAG_DIRECT) {
+		file_dontneed(fd_in, offset, st->chunk_size);
+	}
+}
+
+/* fill an in-memory window from stdin, after the 'have' bytes carried
+   over from the last chunk. Returns the number of bytes in the window */
+static int stdin_fill(uchar *window, int have, int size)
+{
+	ssize_t r;
+
+	while (have < size &&
+	       (r = read(STDIN_FILENO, window+have, size-have)) != 0) {
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			fatal("cannot read from stdin: %s\n", strerror(errno));
+		}
+		have += r;
+	}
+	return have;
+}
+
+/* compress stdin a chunk at a time, reading each chunk straight into
+   an anonymous window rather than through a temporary file */
+static off_t rzip_stdin(struct rzip_state *st, int fd_out, int outpiped)
+{
+	uchar *window;
+	int size, have = 0, eof = 0;
+	off_t total_len = 0;
+
+	if (st->control->compression_level == 0) {
+		size = CHUNK_MULTIPLE;
+	} else {
+		size = st->control->compression_level * CHUNK_MULTIPLE;
+	}
+
+	window = mem_alloc(size);
+	if (!window) {
+		fatal("Failed to allocate %d byte stdin window\n", size);
+	}
+
+	/* anonymous memory is zeroed by MADV_DONTNEED, not just unmapped */
+	st->drop_behind = 0;
+
+	while (!eof) {
+		int chunk;
+
+		chunk = stdin_fill(window, have, size);
+		if (chunk < size)
+			eof = 1;
+		if (chunk == 0)
+			break;
+
+		have = 0;
+		if (!eof && (st->control->flags & FLAG_RSYNCABLE)) {
+			int window_start = size - MIN(size, RSYNC_CHUNK_WINDOW);
+			chunk = window_start +
+				cdc_block(window + window_start, size - window_start,
+					  0, size - window_start, RSYNC_CHUNK_BITS);
+			have = size - chunk;
+		}
+
+		st->chunk_size = chunk;
+		st->chunk_base = total_len;
+		compress_chunk(st, window, fd_out, 0, 0, outpiped);
+		total_len += chunk;
+
+		if (have)
+			memmove(window, window + chunk, have);
+	}
+
+	mem_free(window, size);
+	return total_len;
+}
+
+/* pull the end of a chunk back to a content defined point, so that an
+   edit early in the file doesn't move every later chunk boundary */
+static int rsync_chunk_end(int fd_in, off_t offset, int chunk)
+{
+	uchar *map;
+	off_t start, delta;
+	int window = MIN(chunk, RSYNC_CHUNK_WINDOW);
+	int n;
+
+	start = offset + chunk - window;
+	delta = start % sysconf(_SC_PAGESIZE);
+	map = (uchar *)mmap(NULL,window+delta,PROT_READ,MAP_SHARED,fd_in,start-delta);
+	if (map == (uchar *)-1) {
+		fatal("Failed to map chunk end in rzip_fd\n");
+	}
+
+	n = cdc_block(map+delta, window, 0, window, RSYNC_CHUNK_BITS);
+
+	munmap(map, window+delta);
+	return chunk - window + n;
 }
 
 
@@ -591,7 +1280,15 @@ off_t rzip_fd(struct rzip_control *control, int fd_in, int fd_out)
 
 	init_hash_indexes(st);
 
-	if(!control->in_tmp) {
+	if (control->reference) {
+		index_reference(st);
+	}
+
+	if (control->flags & FLAG_STDIN) {
+		len = 0;
+		control->flags &= ~FLAG_SHOW_PROGRESS;
+		total_len = rzip_stdin(st, fd_out, outpiped);
+	} else if(!control->in_tmp) {
 		if (fstat(fd_in, &s)) {
 			fatal("Failed to stat fd_in in rzip_fd - %s\n", strerror(errno));
 		}
@@ -622,15 +1319,26 @@ off_t rzip_fd(struct rzip_control *control, int fd_in, int fd_out)
 				len=0;
 
 			st->chunk_size = chunk;
+			st->chunk_base = total_len;
 
 			rzip_chunk(st, fd_in, fd_out, 0, pct_base, pct_multiple, outpiped);
 		} else {
-			if (chunk > len) chunk = len;
+			if (chunk >= len) {
+				chunk = len;
+			} else if (control->flags & FLAG_RSYNCABLE) {
+				chunk = rsync_chunk_end(fd_in, s.st_size - len, chunk);
+			}
 
 			pct_base = (100.0 * (s.st_size - len)) / s.st_size;
 			pct_multiple = ((double)chunk) / s.st_size;
 
 			st->chunk_size = chunk;
+			st->chunk_base = total_len;
+
+			st->ra_offset = s.st_size - len + chunk;
+			st->ra_len = MIN(len - chunk,
+					 (off_t)control->readahead_mb * 1024 * 1024);
+			st->ra_done = 0;
 
 			rzip_chunk(st, fd_in, fd_out, s.st_size - len, pct_base, pct_multiple, outpiped);
 			len -= chunk;
@@ -643,13 +1351,23 @@ off_t rzip_fd(struct rzip_control *control, int fd_in, int fd_out)
 	if (st->control->verbosity > 1) {
 		printf("matches=%d match_bytes=%d\n", 
 		       st->stats.matches, st->stats.match_bytes);
+		if (st->stats.rep_matches)
+			printf("rep_matches=%d rep_match_bytes=%d\n",
+			       st->stats.rep_matches, st->stats.rep_match_bytes);
 		printf("literals=%d literal_bytes=%d\n", 
 		       st->stats.literals, st->stats.literal_bytes);
+		if (st->ref_table)
+			printf("ref_matches=%d ref_match_bytes=%d\n",
+			       st->stats.ref_matches, st->stats.ref_match_bytes);
+		if (control->store)
+			printf("store_refs=%d store_ref_bytes=%d\n",
+			       st->stats.store_refs, st->stats.store_ref_bytes);
 		printf("true_tag_positives=%d false_tag_positives=%d\n", 
 		       st->stats.tag_hits, st->stats.tag_misses);
 		printf("inserts=%d match %.3f\n", 
 		       st->stats.inserts,
 		       (1.0 + st->stats.match_bytes) / st->stats.literal_bytes);
+		mem_report();
 	}
 
 	if(!control->out_tmp) {
@@ -660,10 +1378,21 @@ off_t rzip_fd(struct rzip_control *control, int fd_in, int fd_out)
 			printf("%s - compression ratio %.3f\n", 
 			       st->control->infile, 1.0 * total_len / s2.st_size);
 		}
+		if (st->control->verbosity > 0) {
+			printf("stream buffers peak %luk\n",
+			       (unsigned long)(stream_buffer_peak() >> 10));
+		}
 	}
 
 	if (st->hash_table) {
-		free(st->hash_table);
+		mem_free(st->hash_table, sizeof(st->hash_table[0]) << st->hash_bits);
+	}
+	if (st->ref_table) {
+		mem_free(st->ref_table, sizeof(st->ref_table[0]) << st->ref_bits);
+		munmap(st->ref_buf, st->ref_size);
+	}
+	if (st->dups) {
+		free(st->dups);
 	}
 	free(st);
 
@@ -17,10 +17,65 @@
 */
 
 #define RZIP_MAJOR_VERSION 2
-#define RZIP_MINOR_VERSION 1
+#define RZIP_MINOR_VERSION 2
+
+/* the version in the header of a file with no format flags set */
+#define RZIP_PLAIN_MINOR_VERSION 1
 
 #define NUM_STREAMS 2
 
+/* with MAGIC_SPLIT the record fields each get a stream of their own */
+#define SPLIT_STREAMS 4
+#define STREAM_TYPES 0
+#define STREAM_LITERALS 1
+#define STREAM_LENGTHS 2
+#define STREAM_OFFSETS 3
+
+/* control record types */
+#define REC_LITERAL 0
+#define REC_MATCH 1
+#define REC_REF 2
+#define REC_STORE 3
+#define REC_END 4	/* MAGIC_VARINT only; classic chunks end with an
+			   empty literal */
+#define REC_REP 5	/* MAGIC_REPEAT only; REC_REP+i is a match at
+			   the distance in slot i of the repeat cache */
+
+/* the largest stream block size -B allows */
+#define MAX_BLOCK_SIZE (1024*1024*1024)
+
+/* the most read ahead -A allows, in MB */
+#define MAX_READAHEAD_MB 4096
+
+/* the most compression threads -p allows */
+#define MAX_THREADS 1024
+
+/* the distances of the last few matches in a chunk */
+#define REP_OFFSETS 4
+
+/* how each stream block is compressed */
+#define CTYPE_NONE 3
+#define CTYPE_BZIP2 4
+#define CTYPE_LZMA 5
+#define CTYPE_ZSTD 6
+#define CTYPE_LZ4 7
+
+/* -C auto, choosing a codec per block. Never written to a block */
+#define CODEC_AUTO 255
+
+/* the filter a compressed block went through before its codec, kept
+   in the top bits of its c_type */
+#define CTYPE_MASK 0x0F
+#define FILTER_SHIFT 4
+#define FILTER_NONE 0
+#define FILTER_X86 1
+#define FILTER_DELTA1 2
+#define FILTER_DELTA2 3
+#define FILTER_DELTA4 4
+#define FILTER_DELTA8 5
+#define FILTER_TRANSPOSE4 6
+#define FILTER_TRANSPOSE8 7
+
 #define _GNU_SOURCE
 
 #include "config.h"
@@ -50,6 +105,7 @@
 #endif
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #ifndef uchar
 #define uchar unsigned char
@@ -104,27 +160,120 @@ extern int errno;
 #define FLAG_TEST_ONLY 8
 #define FLAG_FORCE_REPLACE 16
 #define FLAG_DECOMPRESS 32
+#define FLAG_RSYNCABLE 64
+#define FLAG_STDIN 128
+#define FLAG_STDOUT 256
+#define FLAG_DIRECT 512
 
+/* format flags stored in bytes 14-15 of the magic header. A file
+   with none of these set can be read by any 2.x runzip and says 2.1;
+   one with any of them set says 2.2, so that older versions and
+   file(1) can tell the two apart */
+#define MAGIC_REFERENCE 1
+#define MAGIC_STORE 2
+#define MAGIC_FORWARD 4
+#define MAGIC_SPLIT 8
+#define MAGIC_VARINT 16
+#define MAGIC_REPEAT 32
+#define MAGIC_BLOCK_CRC 64
+
+#define MAGIC_KNOWN_FLAGS (MAGIC_REFERENCE | MAGIC_STORE | MAGIC_FORWARD | \
+			   MAGIC_SPLIT | MAGIC_VARINT | MAGIC_REPEAT | \
+			   MAGIC_BLOCK_CRC)
+
+/* a positional read or write handed to aio_submit() */
+#define AIO_MAX_IOV 2
+struct aio_req {
+	struct aio_req *next;
+	int fd;
+	int write;
+	struct iovec iov[AIO_MAX_IOV];
+	int iovcnt;
+	off_t offset;
+	ssize_t ret;
+	int err;
+	int done;
+};
 
 struct rzip_control {
 	const char *infile, *outname;
 	const char *in_tmp, *out_tmp;
 	char *outfile;
 	const char *suffix;
+	const char *reference;
+	int fd_ref;
+	const char *store_name;
+	void *store;
 	unsigned compression_level;
+	unsigned readahead_mb;
+	uint32 block_size;
+	unsigned threads;
+	int codec;
+	unsigned max_queued;
 	unsigned flags;
+	unsigned magic_flags;
 	unsigned verbosity;
 };
 
 void fatal(const char *format, ...);
 void err_msg(const char *format, ...);
-off_t runzip_fd(int fd_in, int fd_out, int fd_hist, off_t expected_size, int out_is_pipe, int in_is_pipe);
+off_t runzip_fd(struct rzip_control *control, int fd_in, int fd_out, int fd_hist, off_t expected_size, int out_is_pipe, int in_is_pipe);
+int verify_fd(struct rzip_control *control, int fd_in);
 off_t rzip_fd(struct rzip_control *control, int fd_in, int fd_out);
-void *open_stream_out(int f, int n, int bzip_level, int piped);
-void *open_stream_in(int f, int n, int piped, int *eof);
+uint32 level_block_size(unsigned level);
+void *open_stream_out(struct rzip_control *control, int f, int n,
+		      int bzip_level, int piped);
+void *open_stream_in(struct rzip_control *control, int f, int n,
+		     int piped, int *eof);
 int write_stream(void *ss, int stream, uchar *p, int len);
+void stream_bufsize(void *ss, int stream, int div);
+void stream_filter(void *ss, int stream);
+uchar *stream_space(void *ss, int stream, int len);
+int flush_stream(void *ss);
 int read_stream(void *ss, int stream, uchar *p, int len);
+uchar *stream_take(void *ss, int stream, int *len);
 int close_stream_out(void *ss);
 int close_stream_in(void *ss);
+int verify_stream(struct rzip_control *control, int f, int n, off_t *pos,
+		  int *bad);
+size_t stream_buffer_peak(void);
 void *Realloc(void *p, int size);
+void rep_push(uint32 *rep, uint32 offset);
+uint32 rep_use(uint32 *rep, int i);
+void put_le32(uchar *p, uint32 v);
+uint32 get_le32(const uchar *p);
+int codec_type(const char *name);
+void codec_list(FILE *f);
+int codec_compress(int c_type, int level, uchar *dst, uint32 *dlen,
+		   const uchar *src, uint32 slen);
+int codec_decompress(int c_type, uchar *dst, uint32 dlen,
+		     const uchar *src, uint32 slen);
+int codec_choose(const uchar *buf, uint32 len, int *level);
+uint32 count_entropy(const uint32 *count, uint32 len);
+int filter_choose(const uchar *buf, uint32 len);
+void filter_encode(int f, uchar *dst, const uchar *src, uint32 len);
+int filter_decode(int f, uchar *buf, uchar *tmp, uint32 len);
 uint32 crc32_buffer(const uchar *buf, int n, uint32 crc);
+void *mem_alloc(size_t size);
+void mem_free(void *p, size_t size);
+void mem_willneed(uchar *p, size_t len);
+void mem_dontneed(uchar *lo, uchar *hi);
+void file_willneed(int fd, off_t offset, off_t len);
+void file_dontneed(int fd, off_t offset, off_t len);
+void file_writeback(int fd, off_t *mark, off_t pos, int drop);
+void file_drop(int fd, off_t start, off_t end);
+void mem_report(void);
+int cdc_block(const uchar *p, int len, int min_len, int max_len, int bits);
+int copy_fd(int fd_out, int fd_in, off_t offset, off_t len);
+void *aio_open(int depth);
+void aio_submit(void *a, struct aio_req *req);
+void aio_wait(void *a, struct aio_req *req);
+void aio_close(void *a);
+void read_magic(struct rzip_control *control, int fd_in, off_t *expected_size);
+void *store_open(struct rzip_control *control, const char *fname);
+int store_lookup(void *s, const uchar *buf, uint32 len, off_t offset,
+		 uint32 *archive, off_t *archive_offset);
+void store_commit(void *s, const char *archive, off_t size);
+void store_read(void *s, uint32 archive, off_t offset, uchar *buf, int len);
+int store_holds(void *s, const char *path);
+void store_close(void *s);
@@ -0,0 +1,488 @@
+/*
+   Copyright (C) Andrew Tridgell 1998
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+/* persistent fingerprint store (-F) - remembers the strong hashes of
+   blocks written to earlier archives so that later compressions can
+   refer to them instead of storing them again
+
+   The store file is a 16 byte header followed by records that are only
+   ever appended:
+
+     'A' u16 name_len, name, u32 size_lo, u32 size_hi
+         an archive and the uncompressed size of its contents
+
+     'B' md4[16], u32 offset_lo, u32 offset_hi, u32 len
+         a block at the given uncompressed offset in the archive of
+         the preceding 'A' record
+
+   An archive is identified by the ordinal of its 'A' record. Each
+   compression appends its 'A' record and all of its 'B' records in a
+   single write under an exclusive lock.
+*/
+
+#include "rzip.h"
+#include "md4.h"
+#include <sys/file.h>
+
+#define STORE_MAGIC "RZFS"
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 16
+#define STORE_A_SIZE 11
+#define STORE_B_SIZE 29
+
+/* archive id of blocks from the compression in progress */
+#define STORE_PENDING 0xFFFFFFFF
+
+struct store_entry {
+	uchar md4[MD4_DIGEST_SIZE];
+	uint32 archive;
+	uint32 len;
+	off_t offset;
+};
+
+struct store_archive {
+	char *name;
+	off_t size;
+	int fd;
+};
+
+struct store {
+	const char *fname;
+	int fd;
+	off_t loaded;
+	struct store_entry *table;
+	unsigned int table_bits;
+	unsigned int count;
+	struct store_archive *archives;
+	unsigned int num_archives;
+	struct store_entry **pending;
+	unsigned int num_pending;
+	struct rzip_control *control;
+};
+
+static unsigned int store_hash(struct store *store, const uchar *md4)
+{
+	return get_le32(md4) & ((1 << store->table_bits) - 1);
+}
+
+static struct store_entry *find_entry(struct store *store, const uchar *md4, uint32 len)
+{
+	unsigned int h;
+
+	for (h = store_hash(store, md4); store->table[h].len;
+	     h = (h + 1) & ((1 << store->table_bits) - 1)) {
+		if (store->table[h].len == len &&
+		    memcmp(store->table[h].md4, md4, MD4_DIGEST_SIZE) == 0) {
+			return &store->table[h];
+		}
+	}
+	return &store->table[h];
+}
+
+static struct store_entry *insert_entry(struct store *store, const uchar *md4,
+					uint32 len, uint32 archive, off_t offset);
+
+/* keep the table at most half full */
+static void grow_table(struct store *store)
+{
+	struct store_entry *old = store->table;
+	unsigned int i, old_size = 1 << store->table_bits;
+
+	if (old && store->count < old_size/2) return;
+
+	store->table_bits = old ? store->table_bits + 1 : 16;
+	store->table = calloc(sizeof(store->table[0]), 1 << store->table_bits);
+	if (!store->table) {
+		fatal("Failed to allocate fingerprint table\n");
+	}
+	store->count = 0;
+
+	if (!old) return;
+
+	for (i=0;i<old_size;i++) {
+		if (old[i].len) {
+			insert_entry(store, old[i].md4, old[i].len,
+				     old[i].archive, old[i].offset);
+		}
+	}
+	free(old);
+
+	/* the pending list pointed into the old table */
+	store->num_pending = 0;
+	for (i=0;i<(1U << store->table_bits);i++) {
+		if (store->table[i].len && store->table[i].archive == STORE_PENDING) {
+			store->pending[store->num_pending++] = &store->table[i];
+		}
+	}
+}
+
+static struct store_entry *insert_entry(struct store *store, const uchar *md4,
+					uint32 len, uint32 archive, off_t offset)
+{
+	struct store_entry *e;
+
+	grow_table(store);
+
+	e = find_entry(store, md4, len);
+	if (e->len) return NULL;
+
+	memcpy(e->md4, md4, MD4_DIGEST_SIZE);
+	e->len = len;
+	e->archive = archive;
+	e->offset = offset;
+	store->count++;
+	return e;
+}
+
+/* map the store file and load any records appended since it was last
+   loaded into the in-memory table. Must be called with the store
+   locked */
+static void load_store(struct store *store)
+{
+	const char *fname = store->fname;
+	struct stat st;
+	uchar *map, *p, *end;
+
+	if (fstat(store->fd, &st) != 0) {
+		fatal("Failed to stat fingerprint store %s\n", fname);
+	}
+
+	if (st.st_size == 0) {
+		uchar hdr[STORE_HEADER_SIZE];
+
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, STORE_MAGIC, 4);
+		put_le32(hdr+4, STORE_VERSION);
+		if (write(store->fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+			fatal("Failed to initialise fingerprint store %s\n", fname);
+		}
+		store->loaded = STORE_HEADER_SIZE;
+		return;
+	}
+
+	if (st.st_size == store->loaded) return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, store->fd, 0);
+	if (map == (uchar *)-1) {
+		fatal("Failed to map fingerprint store %s\n", fname);
+	}
+
+	if (st.st_size < STORE_HEADER_SIZE ||
+	    memcmp(map, STORE_MAGIC, 4) != 0 ||
+	    get_le32(map+4) != STORE_VERSION) {
+		fatal("%s is not an rzip fingerprint store\n", fname);
+	}
+
+	p = map + MAX(store->loaded, STORE_HEADER_SIZE);
+	end = map + st.st_size;
+	while (p < end) {
+		if (*p == 'A' && end - p >= STORE_A_SIZE) {
+			struct store_archive *a;
+			int n = p[1] | (p[2]<<8);
+
+			if (end - p < STORE_A_SIZE + n) break;
+
+			store->archives = Realloc(store->archives,
+				(store->num_archives+1) * sizeof(store->archives[0]));
+			if (!store->archives) {
+				fatal("Failed to allocate fingerprint archive list\n");
+			}
+			a = &store->archives[store->num_archives++];
+			a->name = malloc(n+1);
+			if (!a->name) {
+				fatal("Failed to allocate fingerprint archive name\n");
+			}
+			memcpy(a->name, p+3, n);
+			a->name[n] = 0;
+			a->size = get_le32(p+3+n);
+			a->size |= ((off_t)get_le32(p+7+n)) << 32;
+			a->fd = -1;
+			p += STORE_A_SIZE + n;
+		} else if (*p == 'B' && end - p >= STORE_B_SIZE &&
+			   store->num_archives) {
+			struct store_entry *e;
+			off_t offset = get_le32(p+17);
+			offset |= ((off_t)get_le32(p+21)) << 32;
+
+			grow_table(store);
+			e = find_entry(store, p+1, get_le32(p+25));
+			if (!e->len) {
+				insert_entry(store, p+1, get_le32(p+25),
+					     store->num_archives-1, offset);
+			} else if (e->archive == STORE_PENDING) {
+				/* usually our own block coming back */
+				e->archive = store->num_archives-1;
+				e->offset = offset;
+			}
+			p += STORE_B_SIZE;
+		} else {
+			break;
+		}
+	}
+
+	/* a torn append would hide everything after it, so refuse to
+	   build on a damaged store */
+	if (p != end) {
+		fatal("Fingerprint store %s is damaged at offset %.0f\n",
+		      fname, (double)(p - map));
+	}
+
+	store->loaded = st.st_size;
+	munmap(map, st.st_size);
+}
+
+/* open (creating if needed) a fingerprint store */
+void *store_open(struct rzip_control *control, const char *fname)
+{
+	struct store *store;
+
+	store = calloc(sizeof(*store), 1);
+	if (!store) {
+		fatal("Failed to allocate fingerprint store\n");
+	}
+	store->control = control;
+	store->fname = fname;
+
+	store->fd = open(fname, O_RDWR|O_CREAT|O_APPEND, 0666);
+	if (store->fd == -1) {
+		fatal("Failed to open fingerprint store %s: %s\n",
+		      fname, strerror(errno));
+	}
+
+	if (flock(store->fd, LOCK_EX) != 0) {
+		fatal("Failed to lock fingerprint store %s\n", fname);
+	}
+	load_store(store);
+	flock(store->fd, LOCK_UN);
+
+	grow_table(store);
+
+	if (control->verbosity > 0) {
+		printf("fingerprint store: %u blocks in %u archives\n",
+		       store->count, store->num_archives);
+	}
+
+	return (void *)store;
+}
+
+/* look up a block. Return 1 and fill in where to find it if a
+   previous archive holds it, otherwise remember it for store_commit()
+   and return 0 */
+int store_lookup(void *s, const uchar *buf, uint32 len, off_t offset,
+		 uint32 *archive, off_t *archive_offset)
+{
+	struct store *store = s;
+	struct store_entry *e;
+	struct md4_ctx ctx;
+	uchar md4[MD4_DIGEST_SIZE];
+
+	md4_init(&ctx);
+	md4_update(&ctx, buf, len);
+	md4_final(&ctx, md4);
+
+	grow_table(store);
+	e = find_entry(store, md4, len);
+	if (e->len) {
+		if (e->archive == STORE_PENDING) return 0;
+		*archive = e->archive;
+		*archive_offset = e->offset;
+		return 1;
+	}
+
+	e = insert_entry(store, md4, len, STORE_PENDING, offset);
+	if (!e) return 0;
+
+	store->pending = Realloc(store->pending,
+				 (store->num_pending+1) * sizeof(store->pending[0]));
+	if (!store->pending) {
+		fatal("Failed to allocate fingerprint pending list\n");
+	}
+	store->pending[store->num_pending++] = e;
+	return 0;
+}
+
+/* record the blocks of a finished archive in the store, then pick up
+   what has been appended so later files in this run can use them */
+void store_commit(void *s, const char *archive, off_t size)
+{
+	struct store *store = s;
+	uchar *buf, *p;
+	int n = strlen(archive);
+	unsigned int i;
+	size_t len;
+
+	if (n > 0xFFFF) {
+		fatal("Archive name too long for fingerprint store\n");
+	}
+
+	len = STORE_A_SIZE + n + (size_t)store->num_pending * STORE_B_SIZE;
+	buf = malloc(len);
+	if (!buf) {
+		fatal("Failed to allocate fingerprint records\n");
+	}
+
+	p = buf;
+	p[0] = 'A';
+	p[1] = n & 0xFF;
+	p[2] = (n>>8) & 0xFF;
+	memcpy(p+3, archive, n);
+	put_le32(p+3+n, size & 0xFFFFFFFF);
+	put_le32(p+7+n, (uint64_t)size >> 32);
+	p += STORE_A_SIZE + n;
+
+	for (i=0;i<store->num_pending;i++) {
+		struct store_entry *e = store->pending[i];
+		p[0] = 'B';
+		memcpy(p+1, e->md4, MD4_DIGEST_SIZE);
+		put_le32(p+17, e->offset & 0xFFFFFFFF);
+		put_le32(p+21, (uint64_t)e->offset >> 32);
+		put_le32(p+25, e->len);
+		p += STORE_B_SIZE;
+	}
+
+	if (flock(store->fd, LOCK_EX) != 0) {
+		fatal("Failed to lock fingerprint store\n");
+	}
+	if (write(store->fd, buf, len) != (ssize_t)len) {
+		fatal("Failed to append to fingerprint store - %s\n",
+		      strerror(errno));
+	}
+
+	if (store->control->verbosity > 0) {
+		printf("fingerprint store: added %u blocks\n", store->num_pending);
+	}
+
+	store->num_pending = 0;
+	load_store(store);
+	flock(store->fd, LOCK_UN);
+
+	free(buf);
+}
+
+/* decompress a whole archive named in the store into an unlinked
+   temporary file, so blocks can be read back from it */
+static int decode_archive(struct store *store, struct store_archive *a)
+{
+	struct rzip_control control;
+	const char *tmpdir = getenv("TMPDIR");
+	char *tmpname;
+	int fd_in, fd_out, fd_hist;
+	off_t expected_size, size;
+
+	fd_in = open(a->name, O_RDONLY);
+	if (fd_in == -1) {
+		fatal("Failed to open %s from fingerprint store: %s\n",
+		      a->name, strerror(errno));
+	}
+
+	if (!tmpdir) tmpdir = "/tmp";
+	tmpname = malloc(strlen(tmpdir) + 20);
+	if (!tmpname) {
+		fatal("Failed to allocate temporary file name\n");
+	}
+	sprintf(tmpname, "%s/rzip-store-XXXXXX", tmpdir);
+	fd_out = mkstemp(tmpname);
+	if (fd_out == -1) {
+		fatal("Failed to create %s: %s\n", tmpname, strerror(errno));
+	}
+	fd_hist = open(tmpname, O_RDONLY);
+	if (fd_hist == -1) {
+		fatal("Failed to open history file %s\n", tmpname);
+	}
+	unlink(tmpname);
+	free(tmpname);
+
+	memset(&control, 0, sizeof(control));
+	control.infile = a->name;
+	control.store = store;
+	control.verbosity = store->control->verbosity;
+
+	read_magic(&control, fd_in, &expected_size);
+	if (control.magic_flags & MAGIC_REFERENCE) {
+		fatal("%s from fingerprint store needs a reference file\n",
+		      a->name);
+	}
+
+	if (store->control->verbosity > 0) {
+		printf("fingerprint store: decoding %s\n", a->name);
+	}
+
+	size = runzip_fd(&control, fd_in, fd_out, fd_hist, expected_size, 0, 0);
+	if (size != a->size) {
+		fatal("%s has changed since it was added to the fingerprint store\n",
+		      a->name);
+	}
+
+	close(fd_in);
+	close(fd_hist);
+	return fd_out;
+}
+
+/* read a block previously recorded in the store */
+void store_read(void *s, uint32 archive, off_t offset, uchar *buf, int len)
+{
+	struct store *store = s;
+	struct store_archive *a;
+
+	if (archive >= store->num_archives) {
+		fatal("Archive %u is not in the fingerprint store\n", archive);
+	}
+	a = &store->archives[archive];
+
+	if (a->fd == -1) {
+		a->fd = decode_archive(store, a);
+	}
+
+	if (pread(a->fd, buf, len, offset) != len) {
+		fatal("Failed to read %d bytes at %.0f of %s\n",
+		      len, (double)offset, a->name);
+	}
+}
+
+/* return 1 if the store names the archive at path, whose blocks later
+   archives may then be referring to */
+int store_holds(void *s, const char *path)
+{
+	struct store *store = s;
+	char *full = realpath(path, NULL);
+	unsigned int i;
+	int ret = 0;
+
+	if (!full) return 0;
+	for (i=0;i<store->num_archives && !ret;i++) {
+		ret = strcmp(store->archives[i].name, full) == 0;
+	}
+	free(full);
+	return ret;
+}
+
+void store_close(void *s)
+{
+	struct store *store = s;
+	unsigned int i;
+
+	for (i=0;i<store->num_archives;i++) {
+		if (store->archives[i].fd != -1)
+			close(store->archives[i].fd);
+		free(store->archives[i].name);
+	}
+	free(store->archives);
+	free(store->pending);
+	free(store->table);
+	close(store->fd);
+	free(store);
+}
@@ -16,25 +16,109 @@
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 /* multiplex N streams into a file - the streams are passed
-   through bzlib */
+   through one of the codecs in codec.c */
 
 #include "rzip.h"
-#include "bzlib.h"
-
-#define CTYPE_NONE 3
-#define CTYPE_BZIP2 4
+#include <sys/uio.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 typedef uint16 u16;
 typedef uint32 u32;
 
+/* block headers are 13 bytes: the compression type, the compressed
+   and uncompressed lengths, and the offset of the stream's next
+   header. They are built in memory and go out in the same system call
+   as the data they describe */
+#define HEAD_LEN 13
+
+/* with MAGIC_BLOCK_CRC every header, of either format, ends with the
+   CRCs of the block's data as stored and as decompressed, so that a
+   damaged block can be found without decoding the rest of the chunk.
+   The first goes on over the header fields before it, so a damaged
+   length or chain offset is caught too */
+#define CRC_LEN 8
+#define MAX_HEAD_LEN (HEAD_LEN + CRC_LEN)
+
+/* the most block writes left in flight before waiting for the oldest */
+#define AIO_DEPTH 8
+
 struct stream {
 	u32 last_head;
 	uchar *buf;
 	int buflen;
 	int bufp;
+	u32 bufsize;
 	int bzip_level;
+	int codec;
+	int filter;
+	struct fblock *pending, *pending_tail;
+	/* the last block written, waiting for the offset of the next */
+	struct block *held;
+	/* the next block being read ahead */
+	uchar *ahead;
+	uchar ahead_head[MAX_HEAD_LEN];
+	struct aio_req ahead_req;
+};
+
+/* a block of the forward format that was read before its stream
+   needed it */
+struct fblock {
+	struct fblock *next;
+	uchar c_type;
+	u32 c_len;
+	u32 u_len;
+	u32 c_crc;
+	u32 u_crc;
+	uchar *buf;
+};
+
+/* header in front of each pooled buffer */
+struct buf_hdr {
+	struct buf_hdr *next;
+	u32 size;
+	u32 pad;
 };
 
+/* a full stream buffer on its way to the file */
+struct block {
+	struct block *next;
+	int stream;
+	int bzip_level;
+	int codec;
+	int filter;
+	uchar *buf;
+	u32 u_len;
+	uchar *c_buf;
+	u32 c_len;
+	int c_type;
+	u32 c_crc;
+	u32 u_crc;
+	int done;
+	u32 pos;
+	uchar head[MAX_HEAD_LEN];
+	struct aio_req req;
+};
+
+#ifdef HAVE_LIBPTHREAD
+/* workers compressing queued blocks. Blocks are written in the order
+   they were queued, so the file is the same as with no pool at all */
+struct pool {
+	struct stream_info *sinfo;
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct block *head, *tail;
+	struct block *next;
+	int queued;
+	int max_queued;
+	int closing;
+};
+#endif
+
 struct stream_info {
 	struct stream *s;
 	int num_streams;
@@ -45,66 +129,245 @@ struct stream_info {
 	off_t initial_pos;
 	u32 total_read;
 	off_t piped_in;
+	int forward;
+	int ended;
+	int crc;
+	int head_len;
+	int fhead_len;
+	void *aio;
+	struct block *inflight, *inflight_tail;
+	int num_inflight;
+	int direct;
+	off_t wb_mark;
+	/* buffers are recycled rather than handed back to malloc, which
+	   serves blocks this size with mmap and so faults and zeroes them
+	   afresh every time */
+	struct buf_hdr *free_bufs;
+	size_t buf_bytes;
+	size_t buf_peak;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t buf_lock;
+	struct pool *pool;
+#endif
 };
 
+/* largest buffer footprint of any set of streams so far */
+static size_t buf_peak;
+
+/* get a buffer of at least size bytes, or NULL */
+static uchar *buf_get(struct stream_info *sinfo, u32 size)
+{
+	struct buf_hdr *h;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&sinfo->buf_lock);
+#endif
+	h = sinfo->free_bufs;
+	if (h) {
+		sinfo->free_bufs = h->next;
+		if (h->size < size) {
+			sinfo->buf_bytes -= h->size;
+			free(h);
+			h = NULL;
+		}
+	}
+	if (!h) {
+		size = MAX(size, sinfo->bufsize);
+		h = malloc(sizeof(*h) + size);
+		if (h) {
+			h->size = size;
+			sinfo->buf_bytes += size;
+			if (sinfo->buf_bytes > sinfo->buf_peak) {
+				sinfo->buf_peak = sinfo->buf_bytes;
+			}
+		}
+	}
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&sinfo->buf_lock);
+#endif
+	return h ? (uchar *)(h + 1) : NULL;
+}
+
+/* the usable size of a pooled buffer */
+static u32 buf_size(uchar *p)
+{
+	return ((struct buf_hdr *)p - 1)->size;
+}
+
+/* give a buffer back to the pool */
+static void buf_put(struct stream_info *sinfo, uchar *p)
+{
+	struct buf_hdr *h;
+
+	if (!p) return;
+	h = (struct buf_hdr *)p - 1;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&sinfo->buf_lock);
+#endif
+	h->next = sinfo->free_bufs;
+	sinfo->free_bufs = h;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&sinfo->buf_lock);
+#endif
+}
+
+static void buf_init(struct stream_info *sinfo)
+{
+	sinfo->free_bufs = NULL;
+	sinfo->buf_bytes = 0;
+	sinfo->buf_peak = 0;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&sinfo->buf_lock, NULL);
+#endif
+}
+
+/* free the pool. Every buffer must have been given back */
+static void buf_free_all(struct stream_info *sinfo)
+{
+	struct buf_hdr *h;
+
+	while ((h = sinfo->free_bufs)) {
+		sinfo->free_bufs = h->next;
+		free(h);
+	}
+	if (sinfo->buf_peak > buf_peak) {
+		buf_peak = sinfo->buf_peak;
+	}
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_destroy(&sinfo->buf_lock);
+#endif
+}
+
+/* the most memory any one set of streams has held in buffers */
+size_t stream_buffer_peak(void)
+{
+	return buf_peak;
+}
+
 /*
-  try to compress a buffer. If compression fails for whatever reason then
-  leave uncompressed. Return the compression type in c_type and resulting
-  length in c_len
+  try to compress a block. If compression fails for whatever reason then
+  leave it uncompressed. Sets the compression type, and the compressed
+  data and its length if it was compressed
 */
-static void compress_buf(struct stream *s, int *c_type, u32 *c_len)
+static void compress_buf(struct stream_info *sinfo, struct block *b)
 {
-	uchar *c_buf;
-	unsigned int dlen = s->buflen-1;
+	uchar *c_buf, *f_buf = NULL, *src = b->buf;
+	u32 dlen = b->u_len-1;
+
+	int codec = b->codec;
+	int level = b->bzip_level;
+	int filter = FILTER_NONE;
+
+	b->c_type = CTYPE_NONE;
+	b->c_buf = NULL;
+	b->c_len = b->u_len;
+
+	if (level == 0) return;
+
+	/* a stored block is always kept as it came */
+	if (b->filter) {
+		filter = filter_choose(b->buf, b->u_len);
+		if (filter != FILTER_NONE) {
+			f_buf = buf_get(sinfo, b->u_len);
+			if (!f_buf) return;
+			filter_encode(filter, f_buf, b->buf, b->u_len);
+			src = f_buf;
+		}
+	}
 
-	if (s->bzip_level == 0) return;
+	if (codec == CODEC_AUTO) {
+		codec = codec_choose(src, b->u_len, &level);
+		if (codec == CTYPE_NONE) goto out;
+	}
 
-	c_buf = malloc(dlen);
-	if (!c_buf) return;
+	c_buf = buf_get(sinfo, dlen);
+	if (!c_buf) goto out;
 
-	if (BZ2_bzBuffToBuffCompress((char*)c_buf, &dlen, (char*)s->buf, s->buflen, 
-				     s->bzip_level, 0, s->bzip_level*10) != 
-	    BZ_OK) {
-		free(c_buf);
-		return;
+	if (codec_compress(codec, level, c_buf, &dlen,
+			   src, b->u_len) != 0) {
+		buf_put(sinfo, c_buf);
+		goto out;
 	}
 
-	*c_len = dlen;
-	free(s->buf);
-	s->buf = c_buf;
-	*c_type = CTYPE_BZIP2;
+	b->c_len = dlen;
+	b->c_buf = c_buf;
+	b->c_type = codec | (filter << FILTER_SHIFT);
+out:
+	buf_put(sinfo, f_buf);
+}
+
+/* fill in the CRCs of a block that compress_buf() is done with */
+static void sum_block(struct stream_info *sinfo, struct block *b)
+{
+	if (!sinfo->crc) return;
+	b->u_crc = crc32_buffer(b->buf, b->u_len, 0);
+	b->c_crc = b->c_buf ? crc32_buffer(b->c_buf, b->c_len, 0) : b->u_crc;
+}
+
+/* decompress the c_len bytes at src, of compression type c_type, to
+   the u_len bytes at dst. The compressed data is done with once the
+   codec has run, so it holds the copy a filter needs and src must
+   have room for u_len bytes if there is a filter. Return -1 on
+   failure */
+static int decode_block(int c_type, uchar *dst, u32 u_len,
+			uchar *src, u32 c_len)
+{
+	int filter = c_type >> FILTER_SHIFT;
+
+	if (codec_decompress(c_type & CTYPE_MASK, dst, u_len, src, c_len) != 0) {
+		return -1;
+	}
+	if (filter != FILTER_NONE && filter_decode(filter, dst, src, u_len) != 0) {
+		return -1;
+	}
+	return 0;
 }
 
 /*
   try to decompress a buffer. Return 0 on success and -1 on failure.
 */
-static int decompress_buf(struct stream *s, u32 c_len, int c_type)
+static int decompress_buf(struct stream_info *sinfo, struct stream *s,
+			  u32 c_len, int c_type)
 {
 	uchar *c_buf;
-	unsigned int dlen = s->buflen;
-	int bzerr;
 
 	if (c_type == CTYPE_NONE) return 0;
 
 	c_buf = s->buf;
-	s->buf = malloc(dlen);
+	if ((c_type >> FILTER_SHIFT) != FILTER_NONE && buf_size(c_buf) < (u32)s->buflen) {
+		return -1;
+	}
+	s->buf = buf_get(sinfo, s->buflen);
 	if (!s->buf) {
-		err_msg("Failed to allocate %d bytes for decompression\n", dlen);
+		err_msg("Failed to allocate %d bytes for decompression\n", s->buflen);
 		return -1;
 	}
 
-	bzerr = BZ2_bzBuffToBuffDecompress((char*)s->buf, &dlen, (char*)c_buf, c_len, 0, 0);
-	if (bzerr != BZ_OK) {
-		err_msg("Failed to decompress buffer - bzerr=%d\n", bzerr);
+	if (decode_block(c_type, s->buf, s->buflen, c_buf, c_len) != 0) {
 		return -1;
 	}
 
-	if (dlen != s->buflen) {
-		err_msg("Inconsistent length after decompression. Got %d bytes, expected %d\n", dlen, s->buflen);
+	buf_put(sinfo, c_buf);
+	return 0;
+}
+
+/* the CRC a header gives for a block as stored: its len bytes of data
+   at p followed by the fields bytes of the header before the CRCs */
+static u32 stored_crc(const uchar *p, u32 len, const uchar *head, int fields)
+{
+	return crc32_buffer(head, fields, crc32_buffer(p, len, 0));
+}
+
+/* check a CRC worked out for a block against the one its header
+   gave. what says which copy of the block it is */
+static int check_crc(u32 sum, u32 crc, int stream, const char *what)
+{
+	if (sum != crc) {
+		err_msg("CRC mismatch in %s data of a stream %d block\n",
+			what, stream);
 		return -1;
 	}
-
-	free(c_buf);
 	return 0;
 }
 
@@ -176,43 +439,128 @@ static int get_data(struct stream_info *ss, int len, off_t offset, int what)
 	return 1;
 }
 
-/* write to a file, return 0 on success and -1 on failure */
-static int write_buf(int f, uchar *p, int len)
+static void put_u32(uchar *p, u32 v)
 {
-	int ret;
-	ret = write(f, p, len);
-	if (ret == -1) {
-		err_msg("Write of length %d failed - %s\n", len, strerror(errno));
-		return -1;
-	}
-	if (ret != len) {
-		err_msg("Partial write!? asked for %d bytes but got %d\n", len, ret);
-		return -1;
+	p[0] = v & 0xFF;
+	p[1] = (v>>8) & 0xFF;
+	p[2] = (v>>16) & 0xFF;
+	p[3] = (v>>24) & 0xFF;
+}
+
+static u32 get_u32(const uchar *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((u32)p[3]<<24);
+}
+
+static void put_head(uchar *p, struct block *b, u32 next)
+{
+	p[0] = b->c_type;
+	put_u32(p+1, b->c_len);
+	put_u32(p+5, b->u_len);
+	put_u32(p+9, next);
+	put_u32(p+13, crc32_buffer(p, HEAD_LEN, b->c_crc));
+	put_u32(p+17, b->u_crc);
+}
+
+/* the forward format (MAGIC_FORWARD) never goes back to patch a
+   header. Blocks are written one after another, each tagged with its
+   stream, and a chunk ends with a header for the FORWARD_END stream.
+   The headers are 10 bytes: stream, compression type, compressed and
+   uncompressed lengths */
+#define FHEAD_LEN 10
+#define FORWARD_END 0xFF
+
+static void put_fhead(uchar *p, uchar stream, struct block *b)
+{
+	p[0] = stream;
+	p[1] = b->c_type;
+	put_u32(p+2, b->c_len);
+	put_u32(p+6, b->u_len);
+	put_u32(p+10, crc32_buffer(p, FHEAD_LEN, b->c_crc));
+	put_u32(p+14, b->u_crc);
+}
+
+/* write out a set of buffers with one writev() where possible. Return
+   0 on success and -1 on failure */
+static int write_vec(int f, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(f, iov, cnt);
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			err_msg("Write failed - %s\n", strerror(errno));
+			return -1;
+		}
+		while (cnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
 	return 0;
 }
 
-/* write a byte */
-static int write_u8(int f, uchar v)
+/* write to a file, return 0 on success and -1 on failure */
+static int write_buf(int f, uchar *p, int len)
 {
-	return write_buf(f, &v, 1);
+	struct iovec iov;
+
+	iov.iov_base = p;
+	iov.iov_len = len;
+	return write_vec(f, &iov, 1);
 }
 
-/* write a short */
-static int write_u16(int f, u16 v)
+/* read exactly len bytes at an offset, without moving the file
+   position. Return 0 on success and -1 on failure */
+static int pread_buf(int f, uchar *p, int len, off_t offset)
 {
-	uchar p[2];
-	p[0] = v&0xFF;
-	p[1] = (v>>8)&0xFF;
-	return write_buf(f, p, 2);
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(f, p, len, offset);
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			err_msg("Read of length %d failed - %s\n", len, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			err_msg("Partial read!? %d bytes short\n", len);
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
 }
 
-/* write a long */
-static int write_u32(int f, u32 v)
+/* read exactly len bytes from the current position, which may be a
+   pipe. Returns 0 on success, 1 if the file ended before the first
+   byte and -1 on failure */
+static int read_full(int f, uchar *p, int len)
 {
-	if (write_u16(f, v&0xFFFF) != 0 ||
-	    write_u16(f, (v>>16)) != 0) {
-		return -1;
+	ssize_t ret;
+	int got = 0;
+
+	while (got < len) {
+		ret = read(f, p + got, len - got);
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			err_msg("Read of length %d failed - %s\n", len, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			if (got == 0) return 1;
+			err_msg("Partial read!? asked for %d bytes but got %d\n", len, got);
+			return -1;
+		}
+		got += ret;
 	}
 	return 0;
 }
@@ -232,56 +580,395 @@ static int read_buf(int f, uchar *p, int len)
 	return 0;
 }
 
-static int read_u8(int f, uchar *v)
+static void block_free(struct stream_info *sinfo, struct block *b)
+{
+	buf_put(sinfo, b->c_buf);
+	buf_put(sinfo, b->buf);
+	free(b);
+}
+
+/* wait for the oldest block writes until no more than max are left in
+   flight. Return -1 if any of them failed */
+static int block_reap(struct stream_info *sinfo, int max)
 {
-	return read_buf(f, v, 1);
+	struct block *b;
+	int ret = 0;
+
+	while (sinfo->num_inflight > max) {
+		b = sinfo->inflight;
+		sinfo->inflight = b->next;
+		if (!sinfo->inflight) sinfo->inflight_tail = NULL;
+		sinfo->num_inflight--;
+
+		aio_wait(sinfo->aio, &b->req);
+		if (b->req.ret == -1) {
+			err_msg("Write failed - %s\n", strerror(b->req.err));
+			ret = -1;
+		}
+		block_free(sinfo, b);
+	}
+	return ret;
 }
 
-static int read_u16(int f, u16 *v)
+/* start writing a block and its header, given the offset of the next
+   block of its stream (0 for none). Return -1 on failure */
+static int block_submit(struct stream_info *sinfo, struct block *b, u32 next)
 {
-	uchar p[2];
-	if (read_buf(f, p, 2) != 0) {
+	struct aio_req *req = &b->req;
+
+	put_head(b->head, b, next);
+	req->fd = sinfo->fd;
+	req->write = 1;
+	req->iov[0].iov_base = b->head;
+	req->iov[0].iov_len = sinfo->head_len;
+	req->iov[1].iov_base = b->c_buf ? b->c_buf : b->buf;
+	req->iov[1].iov_len = b->c_len;
+	req->iovcnt = 2;
+	req->offset = sinfo->initial_pos + b->pos;
+	aio_submit(sinfo->aio, req);
+
+	b->next = NULL;
+	if (sinfo->inflight_tail) {
+		sinfo->inflight_tail->next = b;
+	} else {
+		sinfo->inflight = b;
+	}
+	sinfo->inflight_tail = b;
+	sinfo->num_inflight++;
+
+	return block_reap(sinfo, AIO_DEPTH);
+}
+
+/* write a compressed block to the file, chaining it onto the previous
+   block of its stream, and free it once written. A header only goes
+   out when the offset of the next block of its stream is known, so
+   the last block of each stream is held back until then. Headers are
+   never patched afterwards and the writes may complete in any order.
+   Return -1 on failure */
+static int write_block(struct stream_info *sinfo, struct block *b)
+{
+	struct stream *s = &sinfo->s[b->stream];
+	struct block *prev;
+	uchar head[FHEAD_LEN + CRC_LEN];
+	struct iovec iov[2];
+	int ret;
+
+	if (sinfo->forward) {
+		put_fhead(head, b->stream, b);
+		iov[0].iov_base = head;
+		iov[0].iov_len = sinfo->fhead_len;
+		iov[1].iov_base = b->c_buf ? b->c_buf : b->buf;
+		iov[1].iov_len = b->c_len;
+		ret = write_vec(sinfo->fd, iov, 2);
+		block_free(sinfo, b);
+		return ret;
+	}
+
+	/* only the compressed copy is needed from here on */
+	if (b->c_buf) {
+		buf_put(sinfo, b->buf);
+		b->buf = NULL;
+	}
+
+	b->pos = sinfo->cur_pos;
+	sinfo->cur_pos += sinfo->head_len + b->c_len;
+
+	prev = s->held;
+	s->held = b;
+	if (block_submit(sinfo, prev, b->pos) != 0) {
 		return -1;
 	}
-	*v = (p[1]<<8) | p[0];
+
+	if (sinfo->direct) {
+		/* everything below the held blocks has been handed over */
+		u32 low = b->pos;
+		int i;
+
+		for (i=0;i<sinfo->num_streams;i++) {
+			low = MIN(low, sinfo->s[i].held->pos);
+		}
+		file_writeback(sinfo->fd, &sinfo->wb_mark,
+			       sinfo->initial_pos + low, 1);
+	}
 	return 0;
 }
 
-static int read_u32(int f, u32 *v)
+#ifdef HAVE_LIBPTHREAD
+static void *pool_worker(void *arg)
 {
-	u16 v1, v2;
+	struct pool *pool = arg;
+	struct block *b;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->next && !pool->closing) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (!pool->next) break;
+
+		b = pool->next;
+		pool->next = b->next;
+		pthread_mutex_unlock(&pool->lock);
 
-	if (read_u16(f, &v1) != 0) {
+		compress_buf(pool->sinfo, b);
+		sum_block(pool->sinfo, b);
+
+		pthread_mutex_lock(&pool->lock);
+		b->done = 1;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* write out compressed blocks from the head of the queue, waiting for
+   them until no more than max_queued are left. Return -1 on failure */
+static int pool_write(struct stream_info *sinfo, int max_queued)
+{
+	struct pool *pool = sinfo->pool;
+	struct block *b;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while ((b = pool->head) && ret == 0) {
+		if (!b->done) {
+			if (pool->queued <= max_queued) break;
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+		pool->head = b->next;
+		if (!pool->head) pool->tail = NULL;
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = write_block(sinfo, b);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+/* hand a full stream buffer to the pool, giving the stream a fresh
+   one. Return -1 on failure */
+static int pool_queue(struct stream_info *sinfo, int stream)
+{
+	struct pool *pool = sinfo->pool;
+	struct stream *s = &sinfo->s[stream];
+	struct block *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
 		return -1;
 	}
-	if (read_u16(f, &v2) != 0) {
+	b->stream = stream;
+	b->bzip_level = s->bzip_level;
+	b->codec = s->codec;
+	b->filter = s->filter;
+	b->buf = s->buf;
+	b->u_len = s->buflen;
+
+	s->buflen = 0;
+	s->buf = buf_get(sinfo, s->bufsize);
+	if (!s->buf) {
+		free(b);
 		return -1;
 	}
-	*v = v2;
-	*v <<= 16;
-	*v |= v1;
-	return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail) {
+		pool->tail->next = b;
+	} else {
+		pool->head = b;
+	}
+	pool->tail = b;
+	if (!pool->next) pool->next = b;
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return pool_write(sinfo, pool->max_queued);
 }
 
-/* seek to a position within a set of streams - return -1 on failure */
-static int seekto(struct stream_info *sinfo, u32 pos)
+/* start up to num_threads workers. Returns NULL if none could be
+   started, in which case the caller compresses each buffer itself */
+static struct pool *pool_start(struct stream_info *sinfo, int num_threads,
+			       int max_queued)
 {
-	off_t spos = pos + sinfo->initial_pos;
-	if (lseek(sinfo->fd, spos, SEEK_SET) != spos) {
-		err_msg("Failed to seek to %d in stream\n", pos);
+	struct pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->threads = calloc(num_threads, sizeof(pool->threads[0]));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pool->sinfo = sinfo;
+	pool->max_queued = max_queued;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i=0;i<num_threads;i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+			break;
+		}
+	}
+	pool->num_threads = i;
+	if (i == 0) {
+		/* nothing would ever compress the queue */
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work);
+		pthread_cond_destroy(&pool->done);
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+/* stop the workers once the queue is empty */
+static void pool_stop(struct pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closing = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0;i<pool->num_threads;i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
+#endif
+
+/* read the next block of the forward format and queue it on its
+   stream. Returns 1 for a block, 0 at the end of the chunk, 2 if the
+   file ended where a chunk could have started and -1 on failure */
+static int forward_read(struct stream_info *sinfo, int eof_ok)
+{
+	uchar head[FHEAD_LEN + CRC_LEN];
+	struct fblock *fb;
+	struct stream *s;
+	int ret;
+
+	ret = read_full(sinfo->fd, head, sinfo->fhead_len);
+	if (ret == 1 && eof_ok) return 2;
+	if (ret != 0) {
+		if (ret == 1) err_msg("Unexpected end of file in streams\n");
 		return -1;
 	}
-	return 0;
+
+	if (head[0] == FORWARD_END) {
+		if (sinfo->crc && crc32_buffer(head, FHEAD_LEN, 0) != get_u32(head+10)) {
+			err_msg("CRC mismatch in chunk end header\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (head[0] >= sinfo->num_streams) {
+		err_msg("Bad stream %d in block header\n", head[0]);
+		return -1;
+	}
+	s = &sinfo->s[head[0]];
+
+	fb = malloc(sizeof(*fb));
+	if (!fb) {
+		return -1;
+	}
+	fb->next = NULL;
+	fb->c_type = head[1];
+	fb->c_len = get_u32(head+2);
+	fb->u_len = get_u32(head+6);
+	fb->c_crc = get_u32(head+10);
+	fb->u_crc = get_u32(head+14);
+	fb->buf = buf_get(sinfo, MAX(fb->c_len, fb->u_len));
+	if (!fb->buf || read_full(sinfo->fd, fb->buf, fb->c_len) != 0) {
+		err_msg("Failed to read %d byte block\n", fb->c_len);
+		buf_put(sinfo, fb->buf);
+		free(fb);
+		return -1;
+	}
+	if (sinfo->crc &&
+	    check_crc(stored_crc(fb->buf, fb->c_len, head, FHEAD_LEN),
+		      fb->c_crc, head[0], "compressed") != 0) {
+		buf_put(sinfo, fb->buf);
+		free(fb);
+		return -1;
+	}
+
+	if (s->pending_tail) {
+		s->pending_tail->next = fb;
+	} else {
+		s->pending = fb;
+	}
+	s->pending_tail = fb;
+	return 1;
+}
+
+/* fill a buffer from the forward format, reading ahead past blocks of
+   the other streams until one for this stream turns up */
+static int forward_fill(struct stream_info *sinfo, int stream)
+{
+	struct stream *s = &sinfo->s[stream];
+	struct fblock *fb;
+	int ret;
+
+	while (!s->pending) {
+		/* once the chunk has ended the stream is left empty */
+		if (sinfo->ended) return 0;
+		ret = forward_read(sinfo, 0);
+		if (ret == 0) sinfo->ended = 1;
+		else if (ret != 1) return -1;
+	}
+
+	fb = s->pending;
+	s->pending = fb->next;
+	if (!s->pending) s->pending_tail = NULL;
+
+	buf_put(sinfo, s->buf);
+	s->buf = fb->buf;
+	s->buflen = fb->u_len;
+	s->bufp = 0;
+	ret = -1;
+	if (decompress_buf(sinfo, s, fb->c_len, fb->c_type) == 0 &&
+	    (!sinfo->crc ||
+	     check_crc(crc32_buffer(s->buf, fb->u_len, 0), fb->u_crc, stream,
+		       "decompressed") == 0)) {
+		ret = 0;
+	}
+	free(fb);
+	return ret;
+}
+
+/* the block headers of an archive are longer if it has block CRCs */
+static void stream_heads(struct rzip_control *control,
+			 struct stream_info *sinfo)
+{
+	sinfo->crc = (control->magic_flags & MAGIC_BLOCK_CRC) ? 1 : 0;
+	sinfo->head_len = HEAD_LEN + (sinfo->crc ? CRC_LEN : 0);
+	sinfo->fhead_len = FHEAD_LEN + (sinfo->crc ? CRC_LEN : 0);
 }
 
 /* open a set of output streams, compressing with the given
    bzip level */
-void *open_stream_out(int f, int n, int bzip_level, int piped)
+void *open_stream_out(struct rzip_control *control, int f, int n,
+		      int bzip_level, int piped)
 {
 	int i;
 	struct stream_info *sinfo;
 
-	sinfo = malloc(sizeof(*sinfo));
+	sinfo = calloc(1, sizeof(*sinfo));
 	if (!sinfo) {
 		return NULL;
 	}
@@ -290,12 +977,17 @@ void *open_stream_out(int f, int n, int bzip_level, int piped)
 	sinfo->cur_pos = 0;
 	sinfo->fd = f;
 	sinfo->piped = piped;
-	if (bzip_level == 0) {
+	if (control->block_size) {
+		sinfo->bufsize = control->block_size;
+	} else if (bzip_level == 0) {
 		sinfo->bufsize = 100*1024;
 	} else {
 		sinfo->bufsize = 100*1024*bzip_level;
 	}
-	sinfo->initial_pos = lseek(f, 0, SEEK_CUR);
+	sinfo->forward = (control->magic_flags & MAGIC_FORWARD) ? 1 : 0;
+	sinfo->initial_pos = sinfo->forward ? 0 : lseek(f, 0, SEEK_CUR);
+	stream_heads(control, sinfo);
+	buf_init(sinfo);
 
 	sinfo->s = (struct stream *)calloc(sizeof(sinfo->s[0]), n);
 	if (!sinfo->s) {
@@ -304,32 +996,82 @@ void *open_stream_out(int f, int n, int bzip_level, int piped)
 	}
 
 	for (i=0;i<n;i++) {
-		sinfo->s[i].buf = malloc(sinfo->bufsize);
+		sinfo->s[i].buf = buf_get(sinfo, sinfo->bufsize);
 		if (!sinfo->s[i].buf) goto failed;
+		sinfo->s[i].bufsize = sinfo->bufsize;
 		sinfo->s[i].bzip_level = bzip_level;
+		sinfo->s[i].codec = control->codec ? control->codec : CTYPE_BZIP2;
 	}
 
-	/* write the initial headers */
+	/* the initial headers are held back like blocks until the first
+	   block of their stream is written */
+	if (sinfo->forward) goto started;
 	for (i=0;i<n;i++) {
-		sinfo->s[i].last_head = sinfo->cur_pos + 9;
-		write_u8(sinfo->fd, CTYPE_NONE);
-		write_u32(sinfo->fd, 0);
-		write_u32(sinfo->fd, 0);
-		write_u32(sinfo->fd, 0);
-		sinfo->cur_pos += 13;
+		struct block *b = calloc(1, sizeof(*b));
+
+		if (!b) goto failed;
+		b->stream = i;
+		b->c_type = CTYPE_NONE;
+		b->pos = sinfo->cur_pos;
+		sinfo->s[i].held = b;
+		sinfo->cur_pos += sinfo->head_len;
 	}
+	sinfo->aio = aio_open(AIO_DEPTH);
+	if (!sinfo->aio) goto failed;
+	sinfo->direct = (control->flags & FLAG_DIRECT) && !piped;
+	sinfo->wb_mark = sinfo->initial_pos;
+
+started:
+#ifdef HAVE_LIBPTHREAD
+	sinfo->pool = NULL;
+	if (control->threads > 1 && bzip_level != 0) {
+		/* without a pool the buffers are compressed in this thread */
+		sinfo->pool = pool_start(sinfo, control->threads,
+					 control->max_queued ? control->max_queued : 2*control->threads);
+	}
+#endif
 	return (void *)sinfo;
 
 failed:
 	for (i=0;i<n;i++) {
-		if (sinfo->s[i].buf) free(sinfo->s[i].buf);
+		buf_put(sinfo, sinfo->s[i].buf);
+		free(sinfo->s[i].held);
 	}
+	if (sinfo->aio) aio_close(sinfo->aio);
+	buf_free_all(sinfo);
+	free(sinfo->s);
 	free(sinfo);
 	return NULL;
 }
 
 /* prepare a set of n streams for reading on file descriptor f */
-void *open_stream_in(int f, int n, int piped, int *eof)
+/* check the empty header that starts each stream of a chunk and gives
+   the offset of its first block. Return -1 if it is damaged */
+static int check_initial_head(struct stream_info *sinfo, const uchar *head)
+{
+	u32 c_len = get_u32(head+1), u_len = get_u32(head+5);
+
+	if (head[0] != CTYPE_NONE) {
+		err_msg("Unexpected initial tag %d in streams\n", head[0]);
+		return -1;
+	}
+	if (c_len != 0) {
+		err_msg("Unexpected initial c_len %d in streams %d\n", c_len, u_len);
+		return -1;
+	}
+	if (u_len != 0) {
+		err_msg("Unexpected initial u_len %d in streams\n", u_len);
+		return -1;
+	}
+	if (sinfo->crc && crc32_buffer(head, HEAD_LEN, 0) != get_u32(head+13)) {
+		err_msg("CRC mismatch in initial stream header\n");
+		return -1;
+	}
+	return 0;
+}
+
+void *open_stream_in(struct rzip_control *control, int f, int n,
+		     int piped, int *eof)
 {
 	int i;
 	struct stream_info *sinfo;
@@ -345,7 +1087,14 @@ void *open_stream_in(int f, int n, int piped, int *eof)
 	sinfo->fd = f;
 	sinfo->piped = piped;
 	sinfo->piped_in = 0;
-	sinfo->initial_pos = lseek(f, 0, SEEK_CUR);
+	sinfo->forward = (control->magic_flags & MAGIC_FORWARD) ? 1 : 0;
+	sinfo->initial_pos = sinfo->forward ? 0 : lseek(f, 0, SEEK_CUR);
+	sinfo->direct = (control->flags & FLAG_DIRECT) && !piped && !sinfo->forward;
+	stream_heads(control, sinfo);
+	/* most blocks are the size the archive was written with, so
+	   buffers of that size can be passed from block to block */
+	sinfo->bufsize = control->block_size;
+	buf_init(sinfo);
 
 	sinfo->s = (struct stream *)calloc(sizeof(sinfo->s[0]), n);
 	if (!sinfo->s) {
@@ -353,54 +1102,58 @@ void *open_stream_in(int f, int n, int piped, int *eof)
 		return NULL;
 	}
 
-	if(get_data(sinfo,n*13,0,GD_LEN_EOF)==0) {
+	if (sinfo->forward) {
+		/* a chunk always has at least one block, so running out
+		   here is the end of the file */
+		switch (forward_read(sinfo, 1)) {
+		case 1:
+			return (void *)sinfo;
+		case 2:
+			*eof = 1;
+			/* FALLTHROUGH */
+		default:
+			buf_free_all(sinfo);
+			free(sinfo->s);
+			free(sinfo);
+			return NULL;
+		}
+	}
+
+	if(get_data(sinfo,n*sinfo->head_len,0,GD_LEN_EOF)==0) {
 		free(sinfo);
 		*eof=1;
 		return NULL;
 	}
 
 	for (i=0;i<n;i++) {
-		uchar c;
-		u32 v1, v2;
+		uchar head[MAX_HEAD_LEN];
 
 	again:
-		if (read_u8(f, &c) != 0) {
-			goto failed;
-		}
-		if (read_u32(f, &v1) != 0) {
-			goto failed;
-		}
-		if (read_u32(f, &v2) != 0) {
-			goto failed;
-		}
-		if (read_u32(f, &sinfo->s[i].last_head) != 0) {
+		if (read_buf(f, head, sinfo->head_len) != 0) {
 			goto failed;
 		}
+		sinfo->s[i].last_head = get_u32(head+9);
 
-		if (c == CTYPE_NONE && v1==0 && v2==0 && sinfo->s[i].last_head==0 &&
-		    i == 0) {
+		if (head[0] == CTYPE_NONE && get_u32(head+1) == 0 &&
+		    get_u32(head+5) == 0 && sinfo->s[i].last_head == 0 &&
+		    i == 0 && !sinfo->crc) {
 			err_msg("Enabling stream close workaround\n");
-			sinfo->initial_pos += 13;
-			get_data(sinfo,13,0,GD_LEN);
+			sinfo->initial_pos += sinfo->head_len;
+			get_data(sinfo,sinfo->head_len,0,GD_LEN);
 			goto again;
 		}
 
-		sinfo->total_read += 13;
+		sinfo->total_read += sinfo->head_len;
 
-		if (c != CTYPE_NONE) {
-			err_msg("Unexpected initial tag %d in streams\n", c);
-			goto failed;
-		}
-		if (v1 != 0) {
-			err_msg("Unexpected initial c_len %d in streams %d\n", v1, v2);
-			goto failed;
-		}
-		if (v2 != 0) {
-			err_msg("Unexpected initial u_len %d in streams\n", v2);
+		if (check_initial_head(sinfo, head) != 0) {
 			goto failed;
 		}
 	}
 
+	/* without an engine the blocks are simply not read ahead */
+	if (!piped) {
+		sinfo->aio = aio_open(n);
+	}
 	return (void *)sinfo;
 
 failed:
@@ -413,94 +1166,184 @@ failed:
 /* flush out any data in a stream buffer. Return -1 on failure */
 static int flush_buffer(struct stream_info *sinfo, int stream)
 {
-	int c_type = CTYPE_NONE;
-	u32 c_len = sinfo->s[stream].buflen;
-	
-	if (seekto(sinfo, sinfo->s[stream].last_head) != 0) {
-		return -1;
-	}
-	if (write_u32(sinfo->fd, sinfo->cur_pos) != 0) {
-		return -1;
-	}
+	struct stream *s = &sinfo->s[stream];
+	struct block *b;
+	int i;
 
-	sinfo->s[stream].last_head = sinfo->cur_pos + 9;
-	if (seekto(sinfo, sinfo->cur_pos) != 0) {
-		return -1;
+	/* a forward reader has to queue every block it reads past, so
+	   the records that use a literal block go out ahead of it */
+	if (sinfo->forward && stream == STREAM_LITERALS) {
+		for (i=0;i<sinfo->num_streams;i++) {
+			if (i != stream && sinfo->s[i].buflen != 0 &&
+			    flush_buffer(sinfo, i) != 0) {
+				return -1;
+			}
+		}
 	}
 
-	compress_buf(&sinfo->s[stream], &c_type, &c_len);
+#ifdef HAVE_LIBPTHREAD
+	if (sinfo->pool) {
+		return pool_queue(sinfo, stream);
+	}
+#endif
 
-	if (write_u8(sinfo->fd, c_type) != 0 ||
-	    write_u32(sinfo->fd, c_len) != 0 ||
-	    write_u32(sinfo->fd, sinfo->s[stream].buflen) != 0 ||
-	    write_u32(sinfo->fd, 0) != 0) {
+	/* the block keeps the buffer until it has been written */
+	b = calloc(1, sizeof(*b));
+	if (!b) {
 		return -1;
 	}
-	sinfo->cur_pos += 13;
-
-	if (write_buf(sinfo->fd, sinfo->s[stream].buf, c_len) != 0) {
+	b->stream = stream;
+	b->bzip_level = s->bzip_level;
+	b->codec = s->codec;
+	b->filter = s->filter;
+	b->buf = s->buf;
+	b->u_len = s->buflen;
+
+	s->buflen = 0;
+	s->buf = buf_get(sinfo, s->bufsize);
+	if (!s->buf) {
+		block_free(sinfo, b);
 		return -1;
 	}
-	sinfo->cur_pos += c_len;
 
-	sinfo->s[stream].buflen = 0;
+	compress_buf(sinfo, b);
+	sum_block(sinfo, b);
+	return write_block(sinfo, b);
+}
 
-	free(sinfo->s[stream].buf);
-	sinfo->s[stream].buf = malloc(sinfo->bufsize);
-	if (!sinfo->s[stream].buf) {
-		return -1;
-	}
-	return 0;
+/* start reading the next block of a stream into a buffer of at least
+   size bytes, so that it is likely to be there when the stream needs
+   it. The blocks of a stream are mostly the same size, so this usually
+   gets all of it */
+static void fill_ahead(struct stream_info *sinfo, struct stream *s, u32 size)
+{
+	struct aio_req *req = &s->ahead_req;
+
+	s->ahead = buf_get(sinfo, size);
+	if (!s->ahead) return;
+
+	req->fd = sinfo->fd;
+	req->write = 0;
+	req->iov[0].iov_base = s->ahead_head;
+	req->iov[0].iov_len = sinfo->head_len;
+	req->iov[1].iov_base = s->ahead;
+	req->iov[1].iov_len = buf_size(s->ahead);
+	req->iovcnt = 2;
+	req->offset = sinfo->initial_pos + s->last_head;
+	aio_submit(sinfo->aio, req);
 }
 
 /* fill a buffer from a stream - return -1 on failure */
 static int fill_buffer(struct stream_info *sinfo, int stream)
 {
-	uchar c_type;
-	u32 u_len, c_len;
-
-	get_data(sinfo, 13, sinfo->s[stream].last_head, GD_OFF);
-
-	if (seekto(sinfo, sinfo->s[stream].last_head) != 0) {
-		return -1;
+	struct stream *s = &sinfo->s[stream];
+	uchar c_type, head[MAX_HEAD_LEN];
+	u32 u_len, c_len, have = 0;
+	off_t pos = sinfo->initial_pos + s->last_head;
+	uchar *buf = NULL;
+
+	if (sinfo->forward) {
+		return forward_fill(sinfo, stream);
 	}
 
-	if (read_u8(sinfo->fd, &c_type) != 0) {
-		return -1;
-	}
-	if (read_u32(sinfo->fd, &c_len) != 0) {
-		return -1;
-	}
-	if (read_u32(sinfo->fd, &u_len) != 0) {
-		return -1;
-	}
-	if (read_u32(sinfo->fd, &sinfo->s[stream].last_head) != 0) {
-		return -1;
+	if (s->ahead) {
+		/* the header and the start of the data were read ahead */
+		ssize_t n;
+
+		aio_wait(sinfo->aio, &s->ahead_req);
+		n = s->ahead_req.ret;
+		buf = s->ahead;
+		s->ahead = NULL;
+		memcpy(head, s->ahead_head, sinfo->head_len);
+		buf_put(sinfo, s->buf);
+		s->buf = NULL;
+		if (n < sinfo->head_len) {
+			err_msg("Failed to read stream header at %lld\n", (long long)pos);
+			buf_put(sinfo, buf);
+			return -1;
+		}
+		have = n - sinfo->head_len;
+	} else if (!sinfo->piped && s->buf) {
+		/* the blocks of a stream are mostly the same size, so read
+		   the header along with as much of the data as the stream's
+		   spent buffer will hold */
+		struct iovec iov[2];
+		ssize_t n;
+
+		buf = s->buf;
+		s->buf = NULL;
+		iov[0].iov_base = head;
+		iov[0].iov_len = sinfo->head_len;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = buf_size(buf);
+		do {
+			n = preadv(sinfo->fd, iov, 2, pos);
+		} while (n == -1 && errno == EINTR);
+		if (n < sinfo->head_len) {
+			err_msg("Failed to read stream header at %lld\n", (long long)pos);
+			buf_put(sinfo, buf);
+			return -1;
+		}
+		have = n - sinfo->head_len;
+	} else {
+		get_data(sinfo, sinfo->head_len, s->last_head, GD_OFF);
+		if (pread_buf(sinfo->fd, head, sinfo->head_len, pos) != 0) {
+			return -1;
+		}
 	}
 
-	sinfo->total_read += 13;
+	c_type = head[0];
+	c_len = get_u32(head+1);
+	u_len = get_u32(head+5);
+	sinfo->total_read += sinfo->head_len;
 
-	get_data(sinfo, c_len, 0, GD_REL);
-	if (sinfo->s[stream].buf) {
-		free(sinfo->s[stream].buf);
-	}
-	sinfo->s[stream].buf = malloc(u_len);
-	if (!sinfo->s[stream].buf) {
-		return -1;
+	if (!buf || buf_size(buf) < MAX(u_len, c_len)) {
+		uchar *nbuf = buf_get(sinfo, MAX(u_len, c_len));
+
+		if (!nbuf) {
+			buf_put(sinfo, buf);
+			return -1;
+		}
+		if (buf) {
+			memcpy(nbuf, buf, MIN(have, c_len));
+		}
+		buf_put(sinfo, buf);
+		buf_put(sinfo, s->buf);
+		buf = nbuf;
 	}
-	if (read_buf(sinfo->fd, sinfo->s[stream].buf, c_len) != 0) {
-		return -1;
+	s->buf = buf;
+
+	if (have < c_len) {
+		get_data(sinfo, c_len, s->last_head + sinfo->head_len, GD_OFF);
+		if (pread_buf(sinfo->fd, buf + have, c_len - have,
+			      pos + sinfo->head_len + have) != 0) {
+			return -1;
+		}
 	}
+	s->last_head = get_u32(head+9);
 
 	sinfo->total_read += c_len;
 
-	sinfo->s[stream].buflen = u_len;
-	sinfo->s[stream].bufp = 0;
+	s->buflen = u_len;
+	s->bufp = 0;
 
-	if (decompress_buf(&sinfo->s[stream], c_len, c_type) != 0) {
+	if (sinfo->crc &&
+	    check_crc(stored_crc(buf, c_len, head, HEAD_LEN), get_u32(head+13),
+		      stream, "compressed") != 0) {
+		return -1;
+	}
+	if (decompress_buf(sinfo, s, c_len, c_type) != 0) {
+		return -1;
+	}
+	if (sinfo->crc &&
+	    check_crc(crc32_buffer(s->buf, u_len, 0), get_u32(head+17),
+		      stream, "decompressed") != 0) {
 		return -1;
 	}
 
+	if (sinfo->aio && s->last_head) {
+		fill_ahead(sinfo, s, MAX(u_len, c_len));
+	}
 	return 0;
 }
 
@@ -510,14 +1353,14 @@ int write_stream(void *ss, int stream, uchar *p, int len)
 	struct stream_info *sinfo = ss;
 
 	while (len) {
-		int n = MIN(sinfo->bufsize - sinfo->s[stream].buflen, len);
+		int n = MIN(sinfo->s[stream].bufsize - sinfo->s[stream].buflen, len);
 
 		memcpy(sinfo->s[stream].buf+sinfo->s[stream].buflen, p, n);
 		sinfo->s[stream].buflen += n;
 		p += n;
 		len -= n;
 
-		if (sinfo->s[stream].buflen == sinfo->bufsize) {
+		if (sinfo->s[stream].buflen == sinfo->s[stream].bufsize) {
 			if (flush_buffer(sinfo, stream) != 0) {
 				return -1;
 			}
@@ -526,6 +1369,42 @@ int write_stream(void *ss, int stream, uchar *p, int len)
 	return 0;
 }
 
+/* cut the blocks of one output stream to 1/div of the size the
+   streams were opened with. Must be called before anything is written
+   to the stream */
+void stream_bufsize(void *ss, int stream, int div)
+{
+	struct stream_info *sinfo = ss;
+
+	sinfo->s[stream].bufsize = sinfo->bufsize / div;
+}
+
+/* let the blocks of one output stream go through a filter chosen for
+   each block before its codec */
+void stream_filter(void *ss, int stream)
+{
+	struct stream_info *sinfo = ss;
+
+	sinfo->s[stream].filter = 1;
+}
+
+/* reserve len bytes at the end of a stream buffer for the caller to
+   fill in directly. Returns NULL if they would fill the buffer, in which
+   case the caller must go through write_stream() so that the buffer is
+   flushed at exactly the same point as before */
+uchar *stream_space(void *ss, int stream, int len)
+{
+	struct stream_info *sinfo = ss;
+	struct stream *s = &sinfo->s[stream];
+	uchar *p;
+
+	if (s->buflen + len >= s->bufsize) return NULL;
+
+	p = s->buf + s->buflen;
+	s->buflen += len;
+	return p;
+}
+
 /* read some data from a stream. Return number of bytes read, or -1
    on failure */
 int read_stream(void *ss, int stream, uchar *p, int len)
@@ -556,11 +1435,44 @@ int read_stream(void *ss, int stream, uchar *p, int len)
 	return ret;
 }
 
+/* hand over everything left unread in the current buffer of a stream,
+   reading its next block first if the buffer is used up, so that the
+   caller can parse it in place. The data stays put until the next read
+   from the stream. Returns NULL on failure */
+uchar *stream_take(void *ss, int stream, int *len)
+{
+	struct stream_info *sinfo = ss;
+	struct stream *s = &sinfo->s[stream];
+	uchar *p;
+
+	if (s->bufp == s->buflen && fill_buffer(sinfo, stream) != 0) {
+		return NULL;
+	}
+	p = s->buf + s->bufp;
+	*len = s->buflen - s->bufp;
+	s->bufp = s->buflen;
+	return p;
+}
+
+/* flush every stream buffer so that the next block of each stream
+   starts from here. Return -1 on failure */
+int flush_stream(void *ss)
+{
+	struct stream_info *sinfo = ss;
+	int i;
+
+	for (i=0;i<sinfo->num_streams;i++) {
+		if (sinfo->s[i].buflen != 0 &&
+		    flush_buffer(sinfo, i) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /* flush and close down a stream. return -1 on failure */
 int close_stream_out(void *ss)
 {
-	ssize_t r,w,l;
-	static char buf[64*1024];
 	struct stream_info *sinfo = ss;
 	int i;
 	for (i=0;i<sinfo->num_streams;i++) {
@@ -568,27 +1480,64 @@ int close_stream_out(void *ss)
 		    flush_buffer(sinfo, i) != 0) {
 			return -1;
 		}
-		if (sinfo->s[i].buf) free(sinfo->s[i].buf);
+		buf_put(sinfo, sinfo->s[i].buf);
 	}
 
-	if(sinfo->piped) {
-		if(lseek(sinfo->fd,0,SEEK_SET)==-1)
-			fatal("cannot seek in temporary file\n");
-
-		while((r=read(sinfo->fd,buf,sizeof(buf)))>0) {
-			w=l=0;
-			while(r>0 && (w=write(STDOUT_FILENO,buf+l,r))>0) {
-				l+=w;
-				r-=w;
-			}
-			if(w<0) {
-				fatal("cannot write to stdout: %s\n",strerror(errno));
+#ifdef HAVE_LIBPTHREAD
+	if (sinfo->pool) {
+		if (pool_write(sinfo, 0) != 0) {
+			return -1;
+		}
+		pool_stop(sinfo->pool);
+	}
+#endif
+
+	if (sinfo->forward) {
+		uchar head[FHEAD_LEN + CRC_LEN];
+		struct block end;
+
+		memset(&end, 0, sizeof(end));
+		end.c_type = CTYPE_NONE;
+		put_fhead(head, FORWARD_END, &end);
+		if (write_buf(sinfo->fd, head, sinfo->fhead_len) != 0) {
+			return -1;
+		}
+	} else {
+		/* the held blocks end their streams */
+		for (i=0;i<sinfo->num_streams;i++) {
+			if (block_submit(sinfo, sinfo->s[i].held, 0) != 0) {
+				return -1;
 			}
+			sinfo->s[i].held = NULL;
+		}
+		if (block_reap(sinfo, 0) != 0) {
+			return -1;
 		}
-		if(r<0) {
-			fatal("cannot read from temporary file: %s\n",strerror(errno));
+		aio_close(sinfo->aio);
+		if (sinfo->direct) {
+			file_drop(sinfo->fd, sinfo->initial_pos,
+				  sinfo->initial_pos + sinfo->cur_pos);
 		}
 
+		/* the writes were all positional, so leave the file position
+		   at the end of the streams for whatever follows */
+		if (lseek(sinfo->fd, sinfo->initial_pos + sinfo->cur_pos,
+			  SEEK_SET) == -1) {
+			err_msg("Failed to seek to end of streams - %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	buf_free_all(sinfo);
+
+	if(sinfo->piped) {
+		struct stat st;
+
+		if(fstat(sinfo->fd,&st)!=0)
+			fatal("cannot stat temporary file\n");
+
+		if(copy_fd(STDOUT_FILENO,sinfo->fd,0,st.st_size)!=0)
+			fatal("cannot copy temporary file to stdout\n");
+
 		if(lseek(sinfo->fd,0,SEEK_SET)==-1 ||
 		   ftruncate(sinfo->fd,0)==-1)
 			fatal("cannot truncate temporary file\n");
@@ -603,15 +1552,35 @@ int close_stream_out(void *ss)
 int close_stream_in(void *ss)
 {
 	struct stream_info *sinfo = ss;
-	int i;
+	struct fblock *fb;
+	int i, ret;
 
-	if (lseek(sinfo->fd, sinfo->initial_pos + sinfo->total_read, 
-		  SEEK_SET) != sinfo->initial_pos + sinfo->total_read) {
+	if (sinfo->forward) {
+		/* skip to the end of the chunk */
+		while (!sinfo->ended && (ret = forward_read(sinfo, 0)) != 0) {
+			if (ret != 1) return -1;
+		}
+	} else if (lseek(sinfo->fd, sinfo->initial_pos + sinfo->total_read, 
+			 SEEK_SET) != sinfo->initial_pos + sinfo->total_read) {
 		return -1;
 	}
+	if (sinfo->direct) {
+		file_dontneed(sinfo->fd, sinfo->initial_pos, sinfo->total_read);
+	}
 	for (i=0;i<sinfo->num_streams;i++) {
-		if (sinfo->s[i].buf) free(sinfo->s[i].buf);
+		while ((fb = sinfo->s[i].pending)) {
+			sinfo->s[i].pending = fb->next;
+			buf_put(sinfo, fb->buf);
+			free(fb);
+		}
+		if (sinfo->s[i].ahead) {
+			aio_wait(sinfo->aio, &sinfo->s[i].ahead_req);
+			buf_put(sinfo, sinfo->s[i].ahead);
+		}
+		buf_put(sinfo, sinfo->s[i].buf);
 	}
+	if (sinfo->aio) aio_close(sinfo->aio);
+	buf_free_all(sinfo);
 
 	if(sinfo->piped) {
 		if(lseek(sinfo->fd,0,SEEK_SET)==-1 ||
@@ -622,3 +1591,302 @@ int close_stream_in(void *ss)
 	free(sinfo);
 	return 0;
 }
+
+/* a block being checked by verify_stream() */
+struct vblock {
+	int stream;
+	off_t pos;
+	int c_type;
+	u32 c_len;
+	u32 u_len;
+	u32 c_crc;
+	u32 u_crc;
+	uchar head[HEAD_LEN];
+	uchar *buf;
+	const char *error;
+};
+
+/* blocks are read in batches of this many per thread, then checked
+   by all the threads at once */
+#define VERIFY_BATCH 4
+
+struct verify {
+	int crc;
+	int fields;
+	struct vblock *blocks;
+	int num;
+	int next;
+	int num_threads;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t *threads;
+	pthread_mutex_t lock;
+#endif
+};
+
+/* check a block against its CRCs and that it decompresses. Returns
+   NULL if it is sound, or what is wrong with it */
+static const char *verify_block(struct verify *v, struct vblock *vb)
+{
+	const char *error = NULL;
+	uchar *u_buf = vb->buf;
+
+	if (v->crc &&
+	    stored_crc(vb->buf, vb->c_len, vb->head, v->fields) != vb->c_crc) {
+		return "compressed data does not match its CRC";
+	}
+	if (vb->c_type == CTYPE_NONE) {
+		if (vb->c_len != vb->u_len) return "bad length in header";
+	} else {
+		u_buf = malloc(MAX(vb->u_len, 1));
+		if (!u_buf) return "out of memory";
+		if (decode_block(vb->c_type, u_buf, vb->u_len,
+				 vb->buf, vb->c_len) != 0) {
+			error = "failed to decompress";
+		}
+	}
+	if (!error && v->crc && crc32_buffer(u_buf, vb->u_len, 0) != vb->u_crc) {
+		error = "decompressed data does not match its CRC";
+	}
+	if (u_buf != vb->buf) free(u_buf);
+	return error;
+}
+
+static void *verify_worker(void *arg)
+{
+	struct verify *v = arg;
+	int i;
+
+	for (;;) {
+#ifdef HAVE_LIBPTHREAD
+		pthread_mutex_lock(&v->lock);
+#endif
+		i = v->next++;
+#ifdef HAVE_LIBPTHREAD
+		pthread_mutex_unlock(&v->lock);
+#endif
+		if (i >= v->num) break;
+		v->blocks[i].error = verify_block(v, &v->blocks[i]);
+	}
+	return NULL;
+}
+
+/* check the blocks read so far, the calling thread working alongside
+   the others, and report the bad ones. Returns the number that were
+   bad */
+static int verify_batch(struct verify *v)
+{
+	int i, bad = 0;
+#ifdef HAVE_LIBPTHREAD
+	int started;
+#endif
+
+	v->next = 0;
+#ifdef HAVE_LIBPTHREAD
+	for (started=0;started<v->num_threads-1 && started<v->num-1;started++) {
+		if (pthread_create(&v->threads[started], NULL, verify_worker, v) != 0) {
+			break;
+		}
+	}
+	verify_worker(v);
+	for (i=0;i<started;i++) {
+		pthread_join(v->threads[i], NULL);
+	}
+#else
+	verify_worker(v);
+#endif
+
+	for (i=0;i<v->num;i++) {
+		struct vblock *vb = &v->blocks[i];
+
+		if (vb->error) {
+			err_msg("Stream %d block at offset %lld: %s\n", vb->stream,
+				(long long)vb->pos, vb->error);
+			bad++;
+		}
+		free(vb->buf);
+	}
+	v->num = 0;
+	return bad;
+}
+
+/* check every block of the chunk that starts at *pos in f, which is
+   read from there on, without decoding the chunk itself. Each bad
+   block is reported and counted in *bad, and *pos is left at the end
+   of the chunk. Returns 0 after a chunk, 1 if the archive has ended
+   and -1 if its structure is too damaged to find the blocks */
+int verify_stream(struct rzip_control *control, int f, int n, off_t *pos,
+		  int *bad)
+{
+	struct stream_info sinfo;
+	struct verify v;
+	uchar head[MAX_HEAD_LEN];
+	int i, ret = 0, batch;
+	off_t start = *pos, end;
+	u32 next;
+
+	memset(&sinfo, 0, sizeof(sinfo));
+	sinfo.forward = (control->magic_flags & MAGIC_FORWARD) ? 1 : 0;
+	stream_heads(control, &sinfo);
+
+	memset(&v, 0, sizeof(v));
+	v.crc = sinfo.crc;
+	v.fields = sinfo.forward ? FHEAD_LEN : HEAD_LEN;
+	v.num_threads = MAX(control->threads, 1);
+	batch = VERIFY_BATCH * v.num_threads;
+	v.blocks = calloc(batch, sizeof(v.blocks[0]));
+#ifdef HAVE_LIBPTHREAD
+	v.threads = calloc(v.num_threads, sizeof(v.threads[0]));
+	if (!v.threads) {
+		free(v.blocks);
+		return -1;
+	}
+	pthread_mutex_init(&v.lock, NULL);
+#endif
+	if (!v.blocks) {
+		ret = -1;
+		goto out;
+	}
+
+	if (sinfo.forward) {
+		/* the blocks follow one another, so this works on a pipe */
+		end = start;
+		for (i=0;;i++) {
+			struct vblock *vb = &v.blocks[v.num];
+
+			ret = read_full(f, head, sinfo.fhead_len);
+			if (ret == 1 && i == 0) {
+				ret = 1;
+				goto out;
+			}
+			if (ret != 0) {
+				err_msg("Unexpected end of file at offset %lld\n",
+					(long long)end);
+				ret = -1;
+				goto out;
+			}
+			if (head[0] == FORWARD_END) {
+				if (sinfo.crc &&
+				    crc32_buffer(head, FHEAD_LEN, 0) != get_u32(head+10)) {
+					err_msg("Bad chunk end at offset %lld\n",
+						(long long)end);
+					ret = -1;
+					goto out;
+				}
+				end += sinfo.fhead_len;
+				break;
+			}
+			vb->stream = head[0];
+			vb->pos = end;
+			vb->c_type = head[1];
+			vb->c_len = get_u32(head+2);
+			vb->u_len = get_u32(head+6);
+			vb->c_crc = get_u32(head+10);
+			vb->u_crc = get_u32(head+14);
+			memcpy(vb->head, head, FHEAD_LEN);
+			if (vb->stream >= n || vb->c_len > vb->u_len ||
+			    vb->u_len > MAX_BLOCK_SIZE) {
+				err_msg("Bad block header at offset %lld\n",
+					(long long)end);
+				ret = -1;
+				goto out;
+			}
+			vb->buf = malloc(MAX(vb->u_len, 1));
+			if (!vb->buf || read_full(f, vb->buf, vb->c_len) != 0) {
+				err_msg("Failed to read %u byte block at offset %lld\n",
+					vb->c_len, (long long)end);
+				free(vb->buf);
+				ret = -1;
+				goto out;
+			}
+			end += sinfo.fhead_len + vb->c_len;
+			if (++v.num == batch) {
+				*bad += verify_batch(&v);
+			}
+		}
+		goto done;
+	}
+
+	/* every stream starts with an empty header, and each header gives
+	   the offset of the next block of its stream. The blocks only
+	   ever chain forwards, and the chunk ends with the last of them */
+	end = n * sinfo.head_len;
+	for (i=0;i<n;i++) {
+		ssize_t r = pread(f, head, sinfo.head_len, start + i*sinfo.head_len);
+
+		if (r == 0 && i == 0) {
+			ret = 1;
+			goto out;
+		}
+		if (r != sinfo.head_len) {
+			err_msg("Failed to read stream header at offset %lld\n",
+				(long long)(start + i*sinfo.head_len));
+			ret = -1;
+			goto out;
+		}
+		if (check_initial_head(&sinfo, head) != 0) {
+			err_msg("Bad stream header at offset %lld\n",
+				(long long)(start + i*sinfo.head_len));
+			ret = -1;
+			goto out;
+		}
+		next = get_u32(head+9);
+
+		while (next) {
+			struct vblock *vb = &v.blocks[v.num];
+			u32 here = next;
+
+			if (pread_buf(f, head, sinfo.head_len, start + here) != 0) {
+				ret = -1;
+				goto out;
+			}
+			vb->stream = i;
+			vb->pos = start + here;
+			vb->c_type = head[0];
+			vb->c_len = get_u32(head+1);
+			vb->u_len = get_u32(head+5);
+			next = get_u32(head+9);
+			vb->c_crc = get_u32(head+13);
+			vb->u_crc = get_u32(head+17);
+			memcpy(vb->head, head, HEAD_LEN);
+			if ((next && next <= here) || vb->c_len > vb->u_len ||
+			    vb->u_len > MAX_BLOCK_SIZE) {
+				err_msg("Bad block header at offset %lld\n",
+					(long long)vb->pos);
+				ret = -1;
+				goto out;
+			}
+			vb->buf = malloc(MAX(vb->u_len, 1));
+			if (!vb->buf ||
+			    pread_buf(f, vb->buf, vb->c_len,
+				      vb->pos + sinfo.head_len) != 0) {
+				free(vb->buf);
+				ret = -1;
+				goto out;
+			}
+			end = MAX(end, (off_t)here + sinfo.head_len + vb->c_len);
+			if (++v.num == batch) {
+				*bad += verify_batch(&v);
+			}
+		}
+	}
+	end += start;
+	if (lseek(f, end, SEEK_SET) != end) {
+		err_msg("Failed to seek to offset %lld\n", (long long)end);
+		ret = -1;
+		goto out;
+	}
+
+done:
+	*pos = end;
+out:
+	if (ret == -1) {
+		(*bad)++;
+	}
+	*bad += verify_batch(&v);
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_destroy(&v.lock);
+	free(v.threads);
+#endif
+	free(v.blocks);
+	return ret;
+}
@@ -14,6 +14,19 @@ ratio() {
     echo $2 $1 | awk '{printf "%5.2f\n", $2/$1}'
 }
 
+same() {
+    if ! cmp $1 $2; then
+	echo "Failed on $1 ($3)!!"
+	exit 1
+    fi
+}
+
+# the codecs to try besides the default, if this rzip has them
+codecs=auto
+if ./rzip -h 2>&1 | grep -- '-C codec' | grep lzma > /dev/null; then
+    codecs="lzma auto"
+fi
+
 ts1=0
 ts2=0
 
@@ -32,11 +45,46 @@ for f in $*; do
 	echo "Failed on $f!!"
 	exit 1
     fi
+    ./rzip -t $tdir/$bname || failed "$f (-t)"
+
+    # the forward format, written to stdout and read from stdin
+    ./rzip -c $f > $tdir/$bname.c || failed "$f (-c)"
+    ./rzip -t - < $tdir/$bname.c || failed "$f (-c -t)"
+    ./rzip -d -c - < $tdir/$bname.c > $tdir/$bname.3 || failed "$f (-c -d)"
+    same $f $tdir/$bname.3 -c
+    ./rzip -d -q $tdir/tmp -c < $tdir/$bname > $tdir/$bname.3 || failed "$f (-q -d -c)"
+    same $f $tdir/$bname.3 "-q -c"
+
+    for o in "-B 1" "-D $f"; do
+	./rzip -k $o $f -o $tdir/$bname.o || failed "$f ($o)"
+	./rzip -k -d $o $tdir/$bname.o -o $tdir/$bname.4 || failed "$f ($o -d)"
+	same $f $tdir/$bname.4 "$o"
+	rm -f $tdir/$bname.o $tdir/$bname.4
+    done
+    for c in $codecs; do
+	./rzip -k -C $c $f -o $tdir/$bname.o || failed "$f (-C $c)"
+	./rzip -t $tdir/$bname.o || failed "$f (-C $c -t)"
+	./rzip -k -d $tdir/$bname.o -o $tdir/$bname.4 || failed "$f (-C $c -d)"
+	same $f $tdir/$bname.4 "-C $c"
+	rm -f $tdir/$bname.o $tdir/$bname.4
+    done
+
+    # a second archive of the same file is mostly fingerprint store hits
+    ./rzip -k -F $tdir/store $f -o $tdir/$bname.o || failed "$f (-F)"
+    ./rzip -k -F $tdir/store $f -o $tdir/$bname.o2 || failed "$f (-F again)"
+    ./rzip -k -d -F $tdir/store $tdir/$bname.o2 -o $tdir/$bname.4 || failed "$f (-F -d)"
+    same $f $tdir/$bname.4 -F
+    rm -f $tdir/$bname.o $tdir/$bname.o2 $tdir/$bname.4 $tdir/store
     ts1=`expr $ts1 + $s1`
     ts2=`expr $ts2 + $s2`
-    rm -f $tdir/$bname.2 $tdir/$bname
+    rm -f $tdir/$bname.2 $tdir/$bname.3 $tdir/$bname.c $tdir/$bname
 done
 
+# an archive written by rzip 2.1, before any of the format flags
+./rzip -t COPYING-2.1.rz || failed "COPYING-2.1.rz (-t)"
+./rzip -k -d COPYING-2.1.rz -o $tdir/COPYING || failed COPYING-2.1.rz
+same COPYING $tdir/COPYING "2.1 archive"
+
 echo ALL OK
 r=`ratio $ts1 $ts2`
 echo $ts1 $ts2 $r
@@ -22,6 +22,10 @@
   tridge, June 1996
   */
 #include "rzip.h"
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define USE_SENDFILE 1
+#endif
 
 
 void *Realloc(void *p, int size)
@@ -30,6 +34,72 @@ void *Realloc(void *p, int size)
 	return (void *)realloc(p, size);
 }
 
+static uint32 gear[256];
+
+/* return the length of the next content defined block in p[0..len).
+   A gear hash covers the last 32 bytes and the block is cut when its
+   top 'bits' bits are all zero, so cut points depend only on nearby
+   data and an edit moves the boundaries around it and no others. The
+   average block is min_len + 2^bits bytes */
+int cdc_block(const uchar *p, int len, int min_len, int max_len, int bits)
+{
+	uint32 h = 0;
+	int i;
+
+	if (!gear[0]) {
+		uint32 x = 0x2545F491;
+		for (i=0;i<256;i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			gear[i] = x;
+		}
+	}
+
+	if (len <= min_len) return len;
+	if (len > max_len) len = max_len;
+
+	for (i = MAX(0, min_len - 32); i < len; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (i >= min_len && (h >> (32 - bits)) == 0) {
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+/* the repeat cache holds the distances of the last REP_OFFSETS
+   matches, most recent first, with unused slots 0 at the end. The
+   compressor and runzip must update it in exactly the same way */
+void rep_push(uint32 *rep, uint32 offset)
+{
+	memmove(rep+1, rep, (REP_OFFSETS-1) * sizeof(rep[0]));
+	rep[0] = offset;
+}
+
+/* a match at the distance in slot i moves it to the front */
+uint32 rep_use(uint32 *rep, int i)
+{
+	uint32 offset = rep[i];
+
+	memmove(rep+1, rep, i * sizeof(rep[0]));
+	rep[0] = offset;
+	return offset;
+}
+
+void put_le32(uchar *p, uint32 v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v>>8) & 0xFF;
+	p[2] = (v>>16) & 0xFF;
+	p[3] = (v>>24) & 0xFF;
+}
+
+uint32 get_le32(const uchar *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32)p[3]<<24);
+}
+
 void err_msg(const char *format, ...)
 {
 	va_list ap;
@@ -53,3 +123,77 @@ void fatal(const char *format, ...)
 	fprintf(stderr, "Fatal error - exiting\n");
 	exit(1);
 }
+
+#define COPY_BUF (1024*1024)
+
+/* copy len bytes of fd_in from offset onwards to the current position
+   of fd_out, which may be a pipe. fd_in's own position is left alone.
+   Where the kernel can move the data itself it never passes through
+   user space; whatever it declines is copied through a large buffer.
+   Return 0 on success or -1 on failure */
+int copy_fd(int fd_out, int fd_in, off_t offset, off_t len)
+{
+	struct stat st;
+	ssize_t n, w;
+	uchar *buf;
+
+	if (fstat(fd_out, &st) != 0) {
+		st.st_mode = 0;
+	}
+
+#ifdef HAVE_SPLICE
+	/* a pipe can take the page cache pages by reference */
+	while (len > 0 && S_ISFIFO(st.st_mode)) {
+		n = splice(fd_in, &offset, fd_out, NULL, MIN(len, COPY_BUF),
+			   SPLICE_F_MORE);
+		if (n <= 0) break;
+		len -= n;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* a file may be able to share or clone the blocks */
+	while (len > 0 && S_ISREG(st.st_mode)) {
+		n = copy_file_range(fd_in, &offset, fd_out, NULL,
+				    MIN(len, COPY_BUF), 0);
+		if (n <= 0) break;
+		len -= n;
+	}
+#endif
+#ifdef USE_SENDFILE
+	while (len > 0) {
+		n = sendfile(fd_out, fd_in, &offset, MIN(len, COPY_BUF));
+		if (n <= 0) break;
+		len -= n;
+	}
+#endif
+	if (len == 0) return 0;
+
+	buf = malloc(COPY_BUF);
+	if (!buf) {
+		err_msg("Failed to allocate %d byte copy buffer\n", COPY_BUF);
+		return -1;
+	}
+	while (len > 0) {
+		n = pread(fd_in, buf, MIN(len, COPY_BUF), offset);
+		if (n <= 0) {
+			err_msg("Failed to read at %.0f - %s\n", (double)offset,
+				n ? strerror(errno) : "unexpected end of file");
+			free(buf);
+			return -1;
+		}
+		offset += n;
+		len -= n;
+		for (w = 0; w < n; ) {
+			ssize_t r = write(fd_out, buf + w, n - w);
+			if (r <= 0) {
+				err_msg("Failed to write %d bytes - %s\n",
+					(int)(n - w), strerror(errno));
+				free(buf);
+				return -1;
+			}
+			w += r;
+		}
+	}
+	free(buf);
+	return 0;
+}